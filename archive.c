@@ -0,0 +1,321 @@
+/*
+
+   garmini - download track log from Garmin GPSs
+   Copyright (C) 2007  Tom Payne
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "garmini.h"
+#include "archive.h"
+
+/* A single tar archive shared by every session.  Sessions hand over batches
+ * of finished files and go straight back to their devices; one writer thread
+ * appends them.  The queue is a lock-free stack: producers push with a
+ * compare and swap, and the writer takes everything pushed so far with one
+ * exchange and reverses it into arrival order.  Whatever the writer takes at
+ * once is committed together, with a single sync in group durability mode
+ * and one per batch in strict mode.  A counting semaphore bounds the batches
+ * in flight, so a session only waits when the writer is a full backlog
+ * behind, and another wakes the writer.
+ *
+ * After every commit the archive ends with its end-of-archive blocks, so it
+ * is always a valid tar file.  Opening an existing archive appends to it,
+ * dropping anything after the last complete entry, such as an entry cut short
+ * by a crash; a file that is not a tar archive is left alone. */
+
+#define GARMINI_ARCHIVE_BACKLOG 16
+#define GARMINI_ARCHIVE_BLOCK 512
+
+typedef struct garmini_archive_batch garmini_archive_batch_t;
+
+struct garmini_archive_batch {
+	garmini_archive_batch_t *next;
+	int nfiles;
+	garmini_output_file_t files[GARMINI_OUTPUT_BATCH];
+};
+
+struct garmini_archive {
+	const char *filename;
+	int fd;
+	off_t end;
+	int durability;
+	int verbose;
+	garmini_archive_batch_t *head;
+	sem_t items;
+	sem_t slots;
+	pthread_t thread;
+};
+
+typedef struct {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char pad[12];
+} garmini_tar_header_t;
+
+_Static_assert(sizeof(garmini_tar_header_t) == 512, "garmini_tar_header_t must be one tar block");
+
+static const char garmini_archive_zeros[2 * GARMINI_ARCHIVE_BLOCK];
+
+static unsigned garmini_tar_checksum(const garmini_tar_header_t *header)
+{
+	garmini_tar_header_t copy = *header;
+	memset(copy.chksum, ' ', sizeof copy.chksum);
+	const unsigned char *p = (const unsigned char *) &copy;
+	unsigned checksum = 0;
+	size_t i;
+	for (i = 0; i < sizeof copy; ++i)
+		checksum += p[i];
+	return checksum;
+}
+
+static void garmini_archive_pwrite(garmini_archive_t *archive, const void *data, size_t size, off_t offset)
+{
+	while (size) {
+		ssize_t n = pwrite(archive->fd, data, size, offset);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			error("%s: %s", archive->filename, strerror(errno));
+		}
+		data = (const char *) data + n;
+		size -= n;
+		offset += n;
+	}
+}
+
+static void garmini_archive_append(garmini_archive_t *archive, const garmini_output_file_t *file)
+{
+	garmini_tar_header_t header;
+	memset(&header, 0, sizeof header);
+	if (strlen(file->filename) >= sizeof header.name)
+		error("%s: %s: name too long", archive->filename, file->filename);
+	strcpy(header.name, file->filename);
+	strcpy(header.mode, "0000644");
+	strcpy(header.uid, "0000000");
+	strcpy(header.gid, "0000000");
+	snprintf(header.size, sizeof header.size, "%011llo", (unsigned long long) file->size);
+	snprintf(header.mtime, sizeof header.mtime, "%011llo", (unsigned long long) time(0));
+	header.typeflag = '0';
+	memcpy(header.magic, "ustar", 6);
+	memcpy(header.version, "00", 2);
+	snprintf(header.chksum, sizeof header.chksum, "%06o", garmini_tar_checksum(&header));
+	garmini_archive_pwrite(archive, &header, sizeof header, archive->end);
+	archive->end += sizeof header;
+	garmini_archive_pwrite(archive, file->data, file->size, archive->end);
+	archive->end += file->size;
+	size_t padding = (GARMINI_ARCHIVE_BLOCK - file->size % GARMINI_ARCHIVE_BLOCK) % GARMINI_ARCHIVE_BLOCK;
+	garmini_archive_pwrite(archive, garmini_archive_zeros, padding, archive->end);
+	archive->end += padding;
+	if (archive->verbose)
+		fprintf(stderr, "%s: archived %s\n", program_name, file->filename);
+}
+
+/* Ends the archive after the entries so far and makes them durable as the
+ * mode asks; the next entry overwrites the end-of-archive blocks. */
+static void garmini_archive_commit(garmini_archive_t *archive)
+{
+	garmini_archive_pwrite(archive, garmini_archive_zeros, sizeof garmini_archive_zeros, archive->end);
+	if (archive->durability != GARMINI_DURABILITY_NONE && fdatasync(archive->fd) == -1)
+		DIE("fdatasync", errno);
+}
+
+static void garmini_archive_batch_free(garmini_archive_batch_t *batch)
+{
+	int i;
+	for (i = 0; i < batch->nfiles; ++i) {
+		free(batch->files[i].filename);
+		free(batch->files[i].data);
+	}
+	free(batch);
+}
+
+/* An empty batch asks the writer to stop. */
+static void *garmini_archive_thread(void *data)
+{
+	garmini_archive_t *archive = data;
+	int stopping = 0;
+	while (!stopping) {
+		while (sem_wait(&archive->items) == -1)
+			if (errno != EINTR)
+				DIE("sem_wait", errno);
+		garmini_archive_batch_t *batch = __atomic_exchange_n(&archive->head, 0, __ATOMIC_ACQUIRE);
+		garmini_archive_batch_t *batches = 0;
+		int nbatches = 0;
+		while (batch) {
+			garmini_archive_batch_t *next = batch->next;
+			batch->next = batches;
+			batches = batch;
+			batch = next;
+			++nbatches;
+		}
+		while (--nbatches > 0)
+			while (sem_wait(&archive->items) == -1)
+				if (errno != EINTR)
+					DIE("sem_wait", errno);
+		int appended = 0;
+		for (batch = batches; batch; batch = batches) {
+			batches = batch->next;
+			if (!batch->nfiles)
+				stopping = 1;
+			int i;
+			for (i = 0; i < batch->nfiles; ++i)
+				garmini_archive_append(archive, batch->files + i);
+			if (batch->nfiles && archive->durability == GARMINI_DURABILITY_STRICT)
+				garmini_archive_commit(archive);
+			else if (batch->nfiles)
+				appended = 1;
+			garmini_archive_batch_free(batch);
+			if (sem_post(&archive->slots) == -1)
+				DIE("sem_post", errno);
+		}
+		if (appended || stopping)
+			garmini_archive_commit(archive);
+	}
+	return 0;
+}
+
+static int garmini_tar_header_valid(const garmini_tar_header_t *header, unsigned long long *size)
+{
+	if (!header->name[0] || memcmp(header->magic, "ustar", 5))
+		return 0;
+	char *endptr;
+	*size = strtoull(header->size, &endptr, 8);
+	if (endptr == header->size)
+		return 0;
+	return strtoul(header->chksum, 0, 8) == garmini_tar_checksum(header);
+}
+
+/* Finds the end of the last complete entry of an existing archive.  Refuses
+ * a file that does not start with a tar header or end-of-archive block,
+ * rather than truncating something that is not an archive at all. */
+static off_t garmini_archive_scan(garmini_archive_t *archive)
+{
+	struct stat st;
+	if (fstat(archive->fd, &st) == -1)
+		DIE("fstat", errno);
+	off_t end = 0;
+	while (end < st.st_size) {
+		garmini_tar_header_t header;
+		unsigned long long size;
+		if (end + GARMINI_ARCHIVE_BLOCK > st.st_size) {
+			if (end == 0)
+				error("%s: not a tar archive", archive->filename);
+			break;
+		}
+		if (pread(archive->fd, &header, sizeof header, end) != sizeof header)
+			DIE("pread", errno);
+		if (!memcmp(&header, garmini_archive_zeros, sizeof header))
+			break;
+		if (!garmini_tar_header_valid(&header, &size)) {
+			if (end == 0)
+				error("%s: not a tar archive", archive->filename);
+			break;
+		}
+		off_t next = end + GARMINI_ARCHIVE_BLOCK + (size + GARMINI_ARCHIVE_BLOCK - 1) / GARMINI_ARCHIVE_BLOCK * GARMINI_ARCHIVE_BLOCK;
+		if (next > st.st_size)
+			break;
+		end = next;
+	}
+	return end;
+}
+
+garmini_archive_t *garmini_archive_new(const char *filename, int durability, int verbose)
+{
+	garmini_archive_t *archive = alloc(sizeof(garmini_archive_t));
+	archive->filename = filename;
+	archive->durability = durability;
+	archive->verbose = verbose;
+	archive->fd = open(filename, O_RDWR | O_CREAT, 0666);
+	if (archive->fd == -1)
+		error("open: %s: %s", filename, strerror(errno));
+	archive->end = garmini_archive_scan(archive);
+	if (ftruncate(archive->fd, archive->end) == -1)
+		error("ftruncate: %s: %s", filename, strerror(errno));
+	archive->head = 0;
+	if (sem_init(&archive->items, 0, 0) == -1)
+		DIE("sem_init", errno);
+	if (sem_init(&archive->slots, 0, GARMINI_ARCHIVE_BACKLOG) == -1)
+		DIE("sem_init", errno);
+	int rc = pthread_create(&archive->thread, 0, garmini_archive_thread, archive);
+	if (rc)
+		DIE("pthread_create", rc);
+	return archive;
+}
+
+static void garmini_archive_push_batch(garmini_archive_t *archive, garmini_archive_batch_t *batch)
+{
+	while (sem_wait(&archive->slots) == -1)
+		if (errno != EINTR)
+			DIE("sem_wait", errno);
+	batch->next = __atomic_load_n(&archive->head, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&archive->head, &batch->next, batch, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+	if (sem_post(&archive->items) == -1)
+		DIE("sem_post", errno);
+}
+
+/* Takes ownership of the files' names and data; their temporary names are
+ * not used. */
+void garmini_archive_push(garmini_archive_t *archive, const garmini_output_file_t *files, int nfiles)
+{
+	garmini_archive_batch_t *batch = alloc(sizeof(garmini_archive_batch_t));
+	memcpy(batch->files, files, nfiles * sizeof(garmini_output_file_t));
+	batch->nfiles = nfiles;
+	garmini_archive_push_batch(archive, batch);
+}
+
+/* Waits for every batch pushed so far to be committed. */
+void garmini_archive_delete(garmini_archive_t *archive)
+{
+	if (archive) {
+		garmini_archive_push_batch(archive, alloc(sizeof(garmini_archive_batch_t)));
+		int rc = pthread_join(archive->thread, 0);
+		if (rc)
+			DIE("pthread_join", rc);
+		sem_destroy(&archive->items);
+		sem_destroy(&archive->slots);
+		if (close(archive->fd) == -1)
+			DIE("close", errno);
+		free(archive);
+	}
+}
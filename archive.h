@@ -0,0 +1,29 @@
+/*
+
+   garmini - download track log from Garmin GPSs
+   Copyright (C) 2007  Tom Payne
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include "output.h"
+
+garmini_archive_t *garmini_archive_new(const char *, int, int);
+void garmini_archive_push(garmini_archive_t *, const garmini_output_file_t *, int);
+void garmini_archive_delete(garmini_archive_t *);
+
+#endif
@@ -0,0 +1,131 @@
+/*
+
+   garmini - download track log from Garmin GPSs
+   Copyright (C) 2007  Tom Payne
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "garmini.h"
+#include "arena.h"
+
+/* Everything a session allocates comes from its arena and is released in one
+ * go when the session is deleted.  Small allocations are carved out of the
+ * current chunk by bumping an offset; a full chunk is simply left behind.
+ * Large allocations get a chunk of their own, linked in behind the current
+ * one, so that growing them is a realloc() of just that chunk.  Memory is not
+ * zeroed, as most callers overwrite it at once. */
+
+#define GARMIN_ARENA_CHUNK (64 * 1024)
+#define GARMIN_ARENA_LARGE (GARMIN_ARENA_CHUNK / 4)
+#define GARMIN_ARENA_ALIGN(size) (((size) + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1))
+
+typedef struct garmin_arena_chunk garmin_arena_chunk_t;
+
+struct garmin_arena_chunk {
+	garmin_arena_chunk_t *next;
+	size_t size;
+	size_t used;
+	max_align_t data[];
+};
+
+struct garmin_arena {
+	garmin_arena_chunk_t *chunks;
+};
+
+garmin_arena_t *garmin_arena_new(void)
+{
+	return alloc(sizeof(garmin_arena_t));
+}
+
+static garmin_arena_chunk_t *garmin_arena_chunk_new(size_t size)
+{
+	garmin_arena_chunk_t *chunk = malloc(sizeof(garmin_arena_chunk_t) + size);
+	if (!chunk)
+		DIE("malloc", errno);
+	chunk->size = size;
+	chunk->used = 0;
+	return chunk;
+}
+
+void *garmin_arena_alloc(garmin_arena_t *arena, size_t size)
+{
+	size = GARMIN_ARENA_ALIGN(size);
+	garmin_arena_chunk_t *chunk = arena->chunks;
+	if (!chunk || chunk->size - chunk->used < size) {
+		if (size > GARMIN_ARENA_LARGE && chunk) {
+			garmin_arena_chunk_t *large = garmin_arena_chunk_new(size);
+			large->next = chunk->next;
+			chunk->next = large;
+			chunk = large;
+		} else {
+			chunk = garmin_arena_chunk_new(size > GARMIN_ARENA_CHUNK ? size : GARMIN_ARENA_CHUNK);
+			chunk->next = arena->chunks;
+			arena->chunks = chunk;
+		}
+	}
+	void *p = (char *) chunk->data + chunk->used;
+	chunk->used += size;
+	return p;
+}
+
+/* The last allocation in a chunk grows in place while the chunk has room, and
+ * an allocation that fills a chunk on its own grows with the chunk.  Anything
+ * else is copied, leaving the old copy until the arena is deleted. */
+void *garmin_arena_realloc(garmin_arena_t *arena, void *p, size_t old_size, size_t size)
+{
+	if (!p)
+		return garmin_arena_alloc(arena, size);
+	old_size = GARMIN_ARENA_ALIGN(old_size);
+	size = GARMIN_ARENA_ALIGN(size);
+	garmin_arena_chunk_t **link;
+	for (link = &arena->chunks; *link; link = &(*link)->next) {
+		garmin_arena_chunk_t *chunk = *link;
+		if ((char *) p + old_size != (char *) chunk->data + chunk->used)
+			continue;
+		size_t offset = (char *) p - (char *) chunk->data;
+		if (size <= chunk->size - offset) {
+			chunk->used = offset + size;
+			return p;
+		}
+		if (offset)
+			break;
+		chunk = realloc(chunk, sizeof(garmin_arena_chunk_t) + size);
+		if (!chunk)
+			DIE("realloc", errno);
+		chunk->size = chunk->used = size;
+		*link = chunk;
+		return chunk->data;
+	}
+	void *q = garmin_arena_alloc(arena, size);
+	memcpy(q, p, old_size < size ? old_size : size);
+	return q;
+}
+
+void garmin_arena_delete(garmin_arena_t *arena)
+{
+	if (arena) {
+		garmin_arena_chunk_t *chunk = arena->chunks;
+		while (chunk) {
+			garmin_arena_chunk_t *next = chunk->next;
+			free(chunk);
+			chunk = next;
+		}
+		free(arena);
+	}
+}
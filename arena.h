@@ -0,0 +1,32 @@
+/*
+
+   garmini - download track log from Garmin GPSs
+   Copyright (C) 2007  Tom Payne
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+typedef struct garmin_arena garmin_arena_t;
+
+garmin_arena_t *garmin_arena_new(void);
+void *garmin_arena_alloc(garmin_arena_t *, size_t);
+void *garmin_arena_realloc(garmin_arena_t *, void *, size_t, size_t);
+void garmin_arena_delete(garmin_arena_t *);
+
+#endif
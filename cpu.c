@@ -0,0 +1,79 @@
+/*
+
+   garmini - download track log from Garmin GPSs
+   Copyright (C) 2007  Tom Payne
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#include <string.h>
+
+#include "garmini.h"
+#include "cpu.h"
+
+/* The best variant the CPU supports is used unless a lower one has been
+ * forced, which is how the variants are tested against each other.  Only x86
+ * has vector variants; elsewhere every kernel is scalar.  A kernel only has
+ * the variants that make bench shows to beat the one below, and above them
+ * uses its best. */
+
+static const char *garmini_cpu_names[] = { "scalar", "sse4.2", "avx2", "avx512" };
+
+static int garmini_cpu_level = -1;
+
+int garmini_cpu_detect(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+		return GARMINI_CPU_AVX512;
+	if (__builtin_cpu_supports("avx2"))
+		return GARMINI_CPU_AVX2;
+	if (__builtin_cpu_supports("sse4.2"))
+		return GARMINI_CPU_SSE42;
+#endif
+	return GARMINI_CPU_SCALAR;
+}
+
+/* Returns -1 if name is not a variant. */
+int garmini_cpu_parse(const char *name)
+{
+	unsigned i;
+	for (i = 0; i < sizeof garmini_cpu_names / sizeof garmini_cpu_names[0]; ++i)
+		if (strcmp(name, garmini_cpu_names[i]) == 0)
+			return i;
+	return -1;
+}
+
+const char *garmini_cpu_name(int level)
+{
+	return garmini_cpu_names[level];
+}
+
+void garmini_cpu_force(int level)
+{
+	if (level > garmini_cpu_detect())
+		error("this CPU does not support %s", garmini_cpu_name(level));
+	__atomic_store_n(&garmini_cpu_level, level, __ATOMIC_RELAXED);
+}
+
+int garmini_cpu(void)
+{
+	int level = __atomic_load_n(&garmini_cpu_level, __ATOMIC_RELAXED);
+	if (level == -1) {
+		level = garmini_cpu_detect();
+		__atomic_store_n(&garmini_cpu_level, level, __ATOMIC_RELAXED);
+	}
+	return level;
+}
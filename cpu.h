@@ -0,0 +1,38 @@
+/*
+
+   garmini - download track log from Garmin GPSs
+   Copyright (C) 2007  Tom Payne
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#ifndef CPU_H
+#define CPU_H
+
+/* Kernels come in variants for successively wider vector units, chosen at
+ * run time so that one binary runs everywhere at full speed. */
+enum {
+	GARMINI_CPU_SCALAR,
+	GARMINI_CPU_SSE42,
+	GARMINI_CPU_AVX2,
+	GARMINI_CPU_AVX512
+};
+
+int garmini_cpu_detect(void);
+int garmini_cpu_parse(const char *);
+const char *garmini_cpu_name(int);
+void garmini_cpu_force(int);
+int garmini_cpu(void);
+
+#endif
@@ -0,0 +1,177 @@
+/*
+
+   garmini - download track log from Garmin GPSs
+   Copyright (C) 2007  Tom Payne
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "faults.h"
+#include "garmini.h"
+
+/* A transport that wraps another and injects faults at configurable rates
+ * from a seeded generator, so that a run against a replay is exactly
+ * repeatable.  The specification is a comma separated list of:
+ *
+ *   seed=N     seed for the generator
+ *   flip=P     probability of flipping one bit of each received byte
+ *   drop=P     probability of silently dropping each write, e.g. an ACK
+ *   stall=P    probability that a read stalls until its timeout
+ *   short=P    probability that a read returns only part of the data
+ */
+
+typedef struct {
+	garmin_transport_t transport;
+	garmin_transport_t *inner;
+	uint64_t state;
+	double flip;
+	double drop;
+	double stall;
+	double _short;
+	int nflips;
+	int ndrops;
+	int nstalls;
+	int nshorts;
+	unsigned char *next;
+	unsigned char *end;
+	unsigned char buf[1024];
+} garmin_faults_t;
+
+static uint64_t garmin_faults_random(garmin_faults_t *faults)
+{
+	uint64_t x = faults->state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	faults->state = x;
+	return x * 0x2545f4914f6cdd1dULL;
+}
+
+static int garmin_faults_happen(garmin_faults_t *faults, double p)
+{
+	return p > 0.0 && (garmin_faults_random(faults) >> 11) * (1.0 / 9007199254740992.0) < p;
+}
+
+static int garmin_faults_read(garmin_transport_t *transport, unsigned char *buf, int size, int64_t timeout)
+{
+	garmin_faults_t *faults = (garmin_faults_t *) transport;
+	if (garmin_faults_happen(faults, faults->stall)) {
+		++faults->nstalls;
+		transport->clock->sleep(transport->clock, timeout);
+		return 0;
+	}
+	if (faults->next == faults->end) {
+		int n = faults->inner->read(faults->inner, faults->buf, sizeof faults->buf, timeout);
+		faults->next = faults->buf;
+		faults->end = faults->buf + n;
+		unsigned char *p;
+		for (p = faults->next; p < faults->end; ++p) {
+			if (garmin_faults_happen(faults, faults->flip)) {
+				*p ^= 1 << (garmin_faults_random(faults) & 7);
+				++faults->nflips;
+			}
+		}
+	}
+	int n = faults->end - faults->next;
+	if (n > size)
+		n = size;
+	if (n > 1 && garmin_faults_happen(faults, faults->_short)) {
+		n = 1 + garmin_faults_random(faults) % (n - 1);
+		++faults->nshorts;
+	}
+	memcpy(buf, faults->next, n);
+	faults->next += n;
+	return n;
+}
+
+static void garmin_faults_write(garmin_transport_t *transport, const unsigned char *buf, int size)
+{
+	garmin_faults_t *faults = (garmin_faults_t *) transport;
+	if (garmin_faults_happen(faults, faults->drop)) {
+		++faults->ndrops;
+		return;
+	}
+	faults->inner->write(faults->inner, buf, size);
+}
+
+static void garmin_faults_delete(garmin_transport_t *transport)
+{
+	garmin_faults_t *faults = (garmin_faults_t *) transport;
+	faults->inner->delete(faults->inner);
+	free(faults);
+}
+
+garmin_transport_t *garmin_faults_new(garmin_transport_t *inner, const char *spec)
+{
+	if (inner->read_packet)
+		error("%s: faults can only be injected into a serial link", inner->name);
+	garmin_faults_t *faults = alloc(sizeof(garmin_faults_t));
+	faults->transport.read = garmin_faults_read;
+	faults->transport.write = garmin_faults_write;
+	faults->transport.delete = garmin_faults_delete;
+	faults->transport.read_packet = 0;
+	faults->transport.write_packet = 0;
+	faults->transport.name = inner->name;
+	faults->transport.clock = inner->clock;
+	faults->transport.baud = inner->baud;
+	faults->inner = inner;
+	faults->state = 1;
+	faults->next = faults->end = faults->buf;
+	char *copy = strdup(spec);
+	if (!copy)
+		DIE("strdup", errno);
+	char *saveptr = 0;
+	char *token;
+	for (token = strtok_r(copy, ",", &saveptr); token; token = strtok_r(0, ",", &saveptr)) {
+		char *value = strchr(token, '=');
+		if (!value)
+			error("invalid fault '%s'", token);
+		*value++ = '\0';
+		char *endptr;
+		if (strcmp(token, "seed") == 0) {
+			faults->state = strtoull(value, &endptr, 0);
+			if (!faults->state)
+				faults->state = 1;
+		} else {
+			double p = strtod(value, &endptr);
+			if (p < 0.0 || 1.0 < p)
+				error("invalid fault probability '%s'", value);
+			if (strcmp(token, "flip") == 0)
+				faults->flip = p;
+			else if (strcmp(token, "drop") == 0)
+				faults->drop = p;
+			else if (strcmp(token, "stall") == 0)
+				faults->stall = p;
+			else if (strcmp(token, "short") == 0)
+				faults->_short = p;
+			else
+				error("invalid fault '%s'", token);
+		}
+		if (endptr == value || *endptr != '\0')
+			error("invalid argument '%s'", value);
+	}
+	free(copy);
+	return &faults->transport;
+}
+
+void garmin_faults_report(garmin_transport_t *transport, FILE *file)
+{
+	garmin_faults_t *faults = (garmin_faults_t *) transport;
+	fprintf(file, "%s: injected %d bit flips, %d dropped writes, %d stalls, %d short reads\n", program_name, faults->nflips, faults->ndrops, faults->nstalls, faults->nshorts);
+}
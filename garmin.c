@@ -22,34 +22,43 @@
 #include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
-#include <sys/times.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
 
 #include "garmin.h"
 #include "garmini.h"
+#include "log.h"
 
 #if __BYTE_ORDER != __LITTLE_ENDIAN
 #error Only little-endian machines are currently supported
 #endif
 
 #define GARMINI_TIMEOUT (10 * 1000)
+#define GARMINI_HANDSHAKE_TIMEOUT (1000 * 1000)
+#define GARMINI_REPLY_TIMEOUT (10 * 1000 * 1000)
+#define GARMINI_BYTE_TIMEOUT (100 * 1000)
+#define GARMINI_ACK_TIMEOUT (250 * 1000)
+#define GARMINI_PAUSE (250 * 1000)
+#define GARMINI_TURNAROUND (100 * 1000)
+#define GARMINI_RETRIES 10
+#define GARMINI_BAD (-2)
 
 enum {
 	DLE = 16,
 	ETX =  3
 };
 
-enum {
-	Pid_Ack_Byte =  6,
-	Pid_Nak_Byte = 21
-};
-
 enum {
 	Pid_Protocol_Array   = 253,
 	Pid_Product_Rqst     = 254,
@@ -134,34 +143,207 @@ typedef struct {
 	char trk_ident[51];
 } D312_Trk_Hdr_Type;
 
-static void garmin_read(garmin_t *garmin)
+static int64_t garmin_real_clock_now(garmin_clock_t *clock)
+{
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		DIE("clock_gettime", errno);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void garmin_real_clock_sleep(garmin_clock_t *clock, int64_t usec)
+{
+	struct timespec ts;
+	ts.tv_sec = usec / 1000000;
+	ts.tv_nsec = usec % 1000000 * 1000;
+	while (nanosleep(&ts, &ts) == -1)
+		if (errno != EINTR)
+			DIE("nanosleep", errno);
+}
+
+garmin_clock_t garmin_real_clock = { garmin_real_clock_now, garmin_real_clock_sleep, 0 };
+
+static int64_t garmin_virtual_clock_now(garmin_clock_t *clock)
+{
+	return __atomic_load_n(&clock->time, __ATOMIC_RELAXED);
+}
+
+static void garmin_virtual_clock_sleep(garmin_clock_t *clock, int64_t usec)
+{
+	__atomic_add_fetch(&clock->time, usec, __ATOMIC_RELAXED);
+}
+
+void garmin_clock_init_virtual(garmin_clock_t *clock)
+{
+	clock->now = garmin_virtual_clock_now;
+	clock->sleep = garmin_virtual_clock_sleep;
+	clock->time = 0;
+}
+
+/* Garmin times count seconds from 1989-12-31 00:00 UTC. */
+time_t garmin_unix_time(uint32_t garmin_time)
+{
+	return (time_t) garmin_time + GARMIN_TIME_OFFSET;
+}
+
+typedef struct {
+	garmin_transport_t transport;
+	int fd;
+} garmin_serial_t;
+
+static int garmin_serial_read(garmin_transport_t *transport, unsigned char *buf, int size, int64_t timeout_usec)
 {
+	garmin_serial_t *serial = (garmin_serial_t *) transport;
 	fd_set readfds;
 	FD_ZERO(&readfds);
-	FD_SET(garmin->fd, &readfds);
+	FD_SET(serial->fd, &readfds);
 	int rc;
 	do {
 		struct timeval timeout;
-		timeout.tv_sec = 0;
-		timeout.tv_usec = GARMINI_TIMEOUT;
-		rc = select(garmin->fd + 1, &readfds, 0, 0, &timeout);
+		timeout.tv_sec = timeout_usec / 1000000;
+		timeout.tv_usec = timeout_usec % 1000000;
+		rc = select(serial->fd + 1, &readfds, 0, 0, &timeout);
 	} while (rc == -1 && errno == EINTR);
 	if (rc == -1)
 		DIE("select", errno);
-	if (FD_ISSET(garmin->fd, &readfds)) {
-		int n;
-		do {
-			n = read(garmin->fd, garmin->buf, sizeof garmin->buf);
-		} while (n == -1 && errno == EINTR);
-		if (n == -1)
-			DIE("read", errno);
-		else if (n == 0)
-			DIE("read", 0);
-		garmin->next = garmin->buf;
-		garmin->end = garmin->buf + n;
-	} else {
-		garmin->next = garmin->end = garmin->buf;
+	if (!FD_ISSET(serial->fd, &readfds))
+		return 0;
+	int n;
+	do {
+		n = read(serial->fd, buf, size);
+	} while (n == -1 && errno == EINTR);
+	if (n == -1)
+		DIE("read", errno);
+	else if (n == 0)
+		DIE("read", 0);
+	return n;
+}
+
+static void garmin_serial_write(garmin_transport_t *transport, const unsigned char *buf, int size)
+{
+	garmin_serial_t *serial = (garmin_serial_t *) transport;
+	int rc;
+	do {
+		rc = write(serial->fd, buf, size);
+	} while (rc == -1 && errno == EINTR);
+	if (rc == -1)
+		DIE("write", errno);
+	if (rc != size)
+		error("%s: short write", transport->name);
+}
+
+static void garmin_serial_delete(garmin_transport_t *transport)
+{
+	garmin_serial_t *serial = (garmin_serial_t *) transport;
+	if (close(serial->fd) == -1)
+		DIE("close", errno);
+	free(serial);
+}
+
+/* Many USB serial adapters hold received bytes for up to 16ms before passing
+ * them on, which with one ACK per packet dominates the transfer time.  The
+ * tuning specification is a comma separated list of:
+ *
+ *   low-latency  ask the driver to deliver bytes at once (ASYNC_LOW_LATENCY)
+ *   vmin=N       return from read() only once N bytes have arrived...
+ *   vtime=N      ...or N tenths of a second have passed since the last byte
+ */
+static void garmin_serial_tune(garmin_serial_t *serial, const char *spec, struct termios *termios)
+{
+	const char *device = serial->transport.name;
+	char *copy = strdup(spec);
+	if (!copy)
+		DIE("strdup", errno);
+	char *saveptr = 0;
+	char *token;
+	for (token = strtok_r(copy, ",", &saveptr); token; token = strtok_r(0, ",", &saveptr)) {
+		if (strcmp(token, "low-latency") == 0) {
+#ifdef __linux__
+			struct serial_struct serial_struct;
+			if (ioctl(serial->fd, TIOCGSERIAL, &serial_struct) == -1) {
+				warning("%s: cannot set low latency: %s", device, strerror(errno));
+				continue;
+			}
+			serial_struct.flags |= ASYNC_LOW_LATENCY;
+			if (ioctl(serial->fd, TIOCSSERIAL, &serial_struct) == -1)
+				warning("%s: cannot set low latency: %s", device, strerror(errno));
+#else
+			warning("%s: cannot set low latency: %s", device, strerror(ENOTSUP));
+#endif
+			continue;
+		}
+		char *value = strchr(token, '=');
+		if (!value)
+			error("invalid serial option '%s'", token);
+		*value++ = '\0';
+		char *endptr;
+		long n = strtol(value, &endptr, 10);
+		if (endptr == value || *endptr != '\0' || n < 0 || 255 < n)
+			error("invalid argument '%s'", value);
+		if (strcmp(token, "vmin") == 0)
+			termios->c_cc[VMIN] = n;
+		else if (strcmp(token, "vtime") == 0)
+			termios->c_cc[VTIME] = n;
+		else
+			error("invalid serial option '%s'", token);
 	}
+	free(copy);
+	if (termios->c_cc[VMIN] > 1 && termios->c_cc[VTIME] == 0)
+		error("%s: vmin greater than one needs a vtime", device);
+}
+
+garmin_transport_t *garmin_serial_new(const char *device, const char *spec)
+{
+	garmin_serial_t *serial = alloc(sizeof(garmin_serial_t));
+	serial->transport.read = garmin_serial_read;
+	serial->transport.write = garmin_serial_write;
+	serial->transport.delete = garmin_serial_delete;
+	serial->transport.read_packet = 0;
+	serial->transport.write_packet = 0;
+	serial->transport.name = device;
+	serial->transport.clock = &garmin_real_clock;
+	serial->transport.baud = 9600;
+	serial->fd = open(device, O_NOCTTY | O_RDWR);
+	if (serial->fd == -1)
+		error("open: %s: %s", device, strerror(errno));
+	if (tcflush(serial->fd, TCIOFLUSH) == -1)
+		error("tcflush: %s: %s", device, strerror(errno));
+	struct termios termios;
+	memset(&termios, 0, sizeof termios);
+	termios.c_iflag = IGNPAR;
+	termios.c_cflag = CLOCAL | CREAD | CS8;
+	cfsetispeed(&termios, B9600);
+	cfsetospeed(&termios, B9600);
+	if (spec)
+		garmin_serial_tune(serial, spec, &termios);
+	if (tcsetattr(serial->fd, TCSANOW, &termios) == -1)
+		error("tcsetattr: %s: %s", device, strerror(errno));
+	return &serial->transport;
+}
+
+/* Reports the settings that the driver actually applied, which for low
+ * latency in particular may silently differ from those requested. */
+void garmin_serial_report(garmin_transport_t *transport, FILE *file)
+{
+	garmin_serial_t *serial = (garmin_serial_t *) transport;
+	struct termios termios;
+	if (tcgetattr(serial->fd, &termios) == -1)
+		error("tcgetattr: %s: %s", transport->name, strerror(errno));
+	const char *low_latency = "unsupported";
+#ifdef __linux__
+	struct serial_struct serial_struct;
+	if (ioctl(serial->fd, TIOCGSERIAL, &serial_struct) != -1)
+		low_latency = serial_struct.flags & ASYNC_LOW_LATENCY ? "on" : "off";
+#endif
+	fprintf(file, "%s: %s: low latency %s, vmin %d, vtime %d\n", program_name, transport->name, low_latency, termios.c_cc[VMIN], termios.c_cc[VTIME]);
+}
+
+static void garmin_read(garmin_t *garmin)
+{
+	int n = garmin->transport->read(garmin->transport, garmin->buf, sizeof garmin->buf, GARMINI_TIMEOUT);
+	garmin->bytes_read += n;
+	garmin->next = garmin->buf;
+	garmin->end = garmin->buf + n;
 }
 
 static int garmin_getc(garmin_t *garmin)
@@ -173,71 +355,130 @@ static int garmin_getc(garmin_t *garmin)
 	return *garmin->next++;
 }
 
+/* Within a frame the device sends without pausing, so a gap of
+ * GARMINI_BYTE_TIMEOUT means that the rest of the frame was lost. */
+static int garmin_getc_frame(garmin_t *garmin)
+{
+	int64_t deadline = garmin->clock->now(garmin->clock) + GARMINI_BYTE_TIMEOUT;
+	int c;
+	while ((c = garmin_getc(garmin)) == EOF)
+		if (garmin->clock->now(garmin->clock) >= deadline)
+			return EOF;
+	return c;
+}
+
 static int garmin_getc_dle(garmin_t *garmin)
 {
-	int c = garmin_getc(garmin);
-	if (c == DLE && garmin_getc(garmin) != DLE)
-		error("%s: expected DLE", garmin->device);
+	int c = garmin_getc_frame(garmin);
+	if (c == DLE && garmin_getc_frame(garmin) != DLE)
+		return GARMINI_BAD;
 	return c;
 }
 
+/* The link is stop-and-wait, so the time from the end of each write to the
+ * end of the next packet read is one round trip: the device's turnaround, the
+ * packet's time on the wire, and any buffering in between. */
+static void garmin_latency_record(garmin_latency_t *latency, int64_t usec)
+{
+	if (usec < 0)
+		usec = 0;
+	if (!latency->count || usec < latency->min)
+		latency->min = usec;
+	if (usec > latency->max)
+		latency->max = usec;
+	latency->total += usec;
+	++latency->count;
+	int bucket = 0;
+	while (bucket < GARMIN_LATENCY_BUCKETS - 1 && usec >> (bucket + 1))
+		++bucket;
+	++latency->buckets[bucket];
+}
+
 static void garmin_log_packet(garmin_t *garmin, const garmin_packet_t *packet, int direction)
 {
-	if (!garmin->logfile)
+	if (!garmin->log)
 		return;
-	fprintf(garmin->logfile, "%c { %3d, \"", direction, packet->id);
-	print_string(garmin->logfile, (char *) packet->data, packet->size);
-	fprintf(garmin->logfile, "\" }\n");
+	char data[4 * sizeof packet->data + 1], *p = data;
+	int i;
+	for (i = 0; i < packet->size; ++i)
+		p += format_char(p, packet->data[i]);
+	*p = '\0';
+	garmin_log_printf(garmin->log, "%c { %3d, \"%s\" }", direction, packet->id, data);
 }
 
-int garmin_read_packet(garmin_t *garmin, garmin_packet_t *packet)
+/* Returns the packet's id, EOF if no frame began, or GARMINI_BAD if the frame
+ * was corrupt or incomplete.  Whatever follows a bad frame until the line
+ * falls quiet is discarded too, so that the next read starts on a frame. */
+static int garmin_read_frame(garmin_t *garmin, garmin_packet_t *packet)
 {
-	memset(packet, 0, sizeof packet);
 	int c = garmin_getc(garmin);
 	if (c == EOF)
 		return EOF;
+	if (c != DLE)
+		goto bad;
 	c = garmin_getc_dle(garmin);
-	if (c == EOF)
-		goto eof;
+	if (c < 0)
+		goto bad;
 	int checksum = packet->id = c;
 	c = garmin_getc_dle(garmin);
-	if (c == EOF)
-		goto eof;
+	if (c < 0)
+		goto bad;
 	checksum += packet->size = c;
 	int i;
 	for (i = 0; i < packet->size; ++i) {
 		c = garmin_getc_dle(garmin);
-		if (c == EOF)
-			goto eof;
+		if (c < 0)
+			goto bad;
 		checksum += packet->data[i] = c;
 	}
 	checksum = (~checksum + 1) & 0xff;
-	c = garmin_getc_dle(garmin);
-	if (c == EOF)
-		goto eof;
-	if (c != checksum)
-		error("%s: checksum failed", garmin->device);
-	c = garmin_getc(garmin);
-	if (c == EOF)
-		goto eof;
-	if (c != DLE)
-		error("%s: expected DLE", garmin->device);
-	c = garmin_getc(garmin);
-	if (c == EOF)
-		goto eof;
-	if (c != ETX)
-		error("%s: expected ETX", garmin->device);
+	if (garmin_getc_dle(garmin) != checksum)
+		goto bad;
+	if (garmin_getc_frame(garmin) != DLE || garmin_getc_frame(garmin) != ETX)
+		goto bad;
+	return packet->id;
+bad:
+	while (garmin_getc(garmin) != EOF)
+		;
+	return GARMINI_BAD;
+}
+
+static int garmin_receive(garmin_t *garmin, garmin_packet_t *packet)
+{
+	memset(packet, 0, sizeof packet);
+	garmin_transport_t *transport = garmin->transport;
+	int rc;
+	if (transport->read_packet)
+		rc = transport->read_packet(transport, packet, GARMINI_TIMEOUT);
+	else
+		rc = garmin_read_frame(garmin, packet);
+	if (rc < 0)
+		return rc;
+	if (transport->read_packet)
+		garmin->bytes_read += packet->size;
+	garmin->received = garmin->clock->now(garmin->clock);
+	if (garmin->sent >= 0) {
+		garmin_latency_record(&garmin->latency, garmin->received - garmin->sent);
+		garmin->sent = -1;
+	}
+	return packet->id;
+}
+
+int garmin_read_packet(garmin_t *garmin, garmin_packet_t *packet)
+{
+	int rc;
+	while ((rc = garmin_receive(garmin, packet)) == GARMINI_BAD)
+		;
+	if (rc == EOF)
+		return EOF;
 	garmin_log_packet(garmin, packet, '<');
 	return packet->id;
-eof:
-	error("%s: incomplete packet", garmin->device);
-	return EOF;
 }
 
-void garmin_write_packet(garmin_t *garmin, garmin_packet_t *packet)
+/* Frames a packet for the serial link into buf, which must hold at least
+ * GARMIN_FRAME_SIZE bytes, and returns the length of the frame. */
+int garmin_frame_packet(const garmin_packet_t *packet, unsigned char *buf)
 {
-	garmin_log_packet(garmin, packet, '>');
-	unsigned char buf[1024];
 	unsigned char *p = buf;
 	*p++ = DLE;
 	unsigned char checksum = *p++ = packet->id;
@@ -258,46 +499,198 @@ void garmin_write_packet(garmin_t *garmin, garmin_packet_t *packet)
 		*p++ = DLE;
 	*p++ = DLE;
 	*p++ = ETX;
-	int rc;
-	do {
-		rc = write(garmin->fd, buf, p - buf);
-	} while (rc == -1 && errno == EINTR);
-	if (rc == -1)
-		DIE("write", errno);
-	if (rc != p - buf)
-		error("%s: short write", garmin->device);
+	return p - buf;
 }
 
-int garmin_read_packet_ack(garmin_t *garmin, garmin_packet_t *packet)
+static void garmin_send(garmin_t *garmin, const garmin_packet_t *packet)
+{
+	garmin_transport_t *transport = garmin->transport;
+	if (transport->write_packet) {
+		transport->write_packet(transport, packet);
+		garmin->bytes_written += packet->size;
+	} else {
+		unsigned char buf[GARMIN_FRAME_SIZE];
+		int size = garmin_frame_packet(packet, buf);
+		transport->write(transport, buf, size);
+		garmin->bytes_written += size;
+	}
+	garmin->sent = garmin->clock->now(garmin->clock);
+}
+
+void garmin_write_packet(garmin_t *garmin, garmin_packet_t *packet)
+{
+	garmin_send(garmin, packet);
+	garmin_log_packet(garmin, packet, '>');
+}
+
+static void garmin_ack(garmin_t *garmin, const garmin_packet_t *packet, garmin_packet_t *ack)
+{
+	ack->id = Pid_Ack_Byte;
+	ack->size = 2;
+	*((uint16_t *) ack->data) = packet->id;
+	garmin->acked = garmin->clock->now(garmin->clock);
+	garmin_latency_record(&garmin->turnaround, garmin->acked - garmin->received);
+	garmin_send(garmin, ack);
+}
+
+static void garmin_nak(garmin_t *garmin)
+{
+	garmin_packet_t nak;
+	nak.id = Pid_Nak_Byte;
+	nak.size = 2;
+	*((uint16_t *) nak.data) = 0;
+	garmin_send(garmin, &nak);
+	garmin_log_packet(garmin, &nak, '>');
+	++garmin->naks;
+}
+
+/* Microseconds that size bytes take on the serial line behind the transport. */
+static int64_t garmin_line_time(garmin_t *garmin, int size)
+{
+	int baud = garmin->transport->baud;
+	return baud ? size * 10 * INT64_C(1000000) / baud : 0;
+}
+
+/* ACKs a packet and returns whether it is new, rather than the last one sent
+ * again by a device that did not get our ACK.  Consecutive packets may well
+ * be identical, so one is only taken for a retransmission if it comes later
+ * than the device could have sent it after our ACK, by GARMINI_TURNAROUND
+ * beyond the time both frames take on the line, and no later than the device
+ * would give up. */
+static int garmin_accept(garmin_t *garmin, const garmin_packet_t *packet)
 {
-	if (garmin_read_packet(garmin, packet) == EOF)
-		return EOF;
 	garmin_packet_t ack;
-	ack.id = Pid_Ack_Byte;
-	ack.size = 2;
-	*((uint16_t *) ack.data) = packet->id;
-	garmin_write_packet(garmin, &ack);
+	unsigned char buf[GARMIN_FRAME_SIZE];
+	int64_t elapsed = garmin->received - garmin->acked;
+	int same = garmin->has_last && packet->id == garmin->last.id && packet->size == garmin->last.size && !memcmp(packet->data, garmin->last.data, packet->size);
+	garmin_ack(garmin, packet, &ack);
+	garmin_log_packet(garmin, packet, '<');
+	garmin_log_packet(garmin, &ack, '>');
+	garmin->failures = 0;
+	if (same) {
+		int64_t line = garmin_line_time(garmin, garmin_frame_packet(&ack, buf) + garmin_frame_packet(packet, buf));
+		if (elapsed > line + GARMINI_TURNAROUND && elapsed <= GARMINI_REPLY_TIMEOUT) {
+			++garmin->duplicates;
+			return 0;
+		}
+	}
+	garmin->last = *packet;
+	garmin->has_last = 1;
+	return 1;
+}
+
+/* The device sends nothing until it has our ACK, so the ACK goes out as soon
+ * as the packet has been verified; the packet is logged afterwards, while the
+ * device is already transmitting the next one.  A corrupt packet is NAKed, so
+ * that the device sends it again, and ACKs that arrive late, after we sent a
+ * packet again, are skipped. */
+int garmin_read_packet_ack(garmin_t *garmin, garmin_packet_t *packet)
+{
+	if (garmin->has_pending) {
+		*packet = garmin->pending;
+		garmin->has_pending = 0;
+		return packet->id;
+	}
+	while (1) {
+		int rc = garmin_receive(garmin, packet);
+		if (rc == EOF)
+			return EOF;
+		if (garmin->transport->read_packet) {
+			garmin_log_packet(garmin, packet, '<');
+			return packet->id;
+		}
+		if (rc == GARMINI_BAD) {
+			if (++garmin->failures > GARMINI_RETRIES)
+				error("%s: too many corrupt packets", garmin->device);
+			garmin_nak(garmin);
+		} else if (rc == Pid_Ack_Byte || rc == Pid_Nak_Byte) {
+			garmin_log_packet(garmin, packet, '<');
+		} else if (garmin_accept(garmin, packet)) {
+			return packet->id;
+		}
+	}
+}
+
+/* Warnings about a session also go to its log, so that they can be read in
+ * context. */
+static void garmin_warning(garmin_t *garmin, const char *format, ...)
+{
+	char message[256];
+	va_list ap;
+	va_start(ap, format);
+	vsnprintf(message, sizeof message, format, ap);
+	va_end(ap);
+	if (garmin->log)
+		garmin_log_printf(garmin->log, "! %s", message);
+	warning("%s: %s", garmin->device, message);
+}
+
+/* Each read gives up after GARMINI_TIMEOUT, which a device that is busy
+ * between packets easily exceeds, so waiting for a packet retries until an
+ * overall deadline. */
+static int garmin_wait_packet_ack(garmin_t *garmin, garmin_packet_t *packet)
+{
+	int64_t deadline = garmin->clock->now(garmin->clock) + GARMINI_REPLY_TIMEOUT;
+	while (garmin_read_packet_ack(garmin, packet) == EOF)
+		if (garmin->clock->now(garmin->clock) >= deadline)
+			return EOF;
 	return packet->id;
 }
 
 int garmin_expect_packet_ack(garmin_t *garmin, garmin_packet_t *packet, int id)
 {
-	while (garmin_read_packet_ack(garmin, packet) != id)
-		warning("%s: unexpected packet %d", garmin->device, packet->id);
+	int64_t deadline = garmin->clock->now(garmin->clock) + GARMINI_REPLY_TIMEOUT;
+	int rc;
+	while ((rc = garmin_read_packet_ack(garmin, packet)) != id) {
+		if (rc != EOF)
+			garmin_warning(garmin, "unexpected packet %d", packet->id);
+		else if (garmin->clock->now(garmin->clock) >= deadline)
+			error("%s: timeout waiting for packet %d", garmin->device, id);
+	}
 	return packet->id;
 }
 
+/* Sends a packet until the device ACKs it, again after a NAK, a corrupt
+ * reply or no reply within GARMINI_ACK_TIMEOUT.  Meanwhile the device may
+ * send its last packet again, if our ACK to it was lost, which is ACKed
+ * again, or already its next one, if only its ACK to ours was, which stands
+ * for the ACK and is kept for the next read.  Once the device ACKs ours, it
+ * sends nothing before it again. */
 void garmin_write_packet_ack(garmin_t *garmin, garmin_packet_t *packet)
 {
 	garmin_write_packet(garmin, packet);
-	garmin_packet_t ack;
-	garmin_read_packet(garmin, &ack);
-	if (ack.id != Pid_Ack_Byte)
-		error("%s: expected ack packet", garmin->device);
-	if (ack.size < 1)
-		error("%s: ack packet too short", garmin->device);
-	else if ((ack.size == 1 && *(uint8_t *) ack.data != packet->id) || (ack.size == 2 && *(uint16_t *) ack.data != packet->id))
-		error("%s: ack to wrong packet!", garmin->device);
+	if (garmin->transport->write_packet)
+		return;
+	int64_t deadline = garmin->clock->now(garmin->clock) + GARMINI_ACK_TIMEOUT;
+	while (1) {
+		garmin_packet_t reply;
+		int rc = garmin_receive(garmin, &reply);
+		if (rc == Pid_Ack_Byte || rc == Pid_Nak_Byte)
+			garmin_log_packet(garmin, &reply, '<');
+		if (rc == Pid_Ack_Byte) {
+			if (reply.size >= 1 && reply.data[0] == packet->id) {
+				garmin->failures = 0;
+				garmin->has_last = 0;
+				return;
+			}
+			continue;
+		}
+		if (rc >= 0 && rc != Pid_Nak_Byte) {
+			if (garmin_accept(garmin, &reply)) {
+				garmin->pending = reply;
+				garmin->has_pending = 1;
+				return;
+			}
+			continue;
+		}
+		if (rc == EOF && garmin->clock->now(garmin->clock) < deadline)
+			continue;
+		if (++garmin->failures > GARMINI_RETRIES)
+			error("%s: no ack to packet %d", garmin->device, packet->id);
+		++garmin->retransmissions;
+		garmin_write_packet(garmin, packet);
+		deadline = garmin->clock->now(garmin->clock) + GARMINI_ACK_TIMEOUT;
+	}
 }
 
 Protocol_Data_Type *garmin_grep_protocol(garmin_t *garmin, int tag, int data)
@@ -309,53 +702,65 @@ Protocol_Data_Type *garmin_grep_protocol(garmin_t *garmin, int tag, int data)
 	return 0;
 }
 
-garmin_t *garmin_new(const char *device, FILE *logfile)
+garmin_t *garmin_new_transport(garmin_transport_t *transport, garmin_log_t *log)
 {
-	garmin_t *garmin = alloc(sizeof(garmin_t));
-	garmin->device = device;
-	garmin->fd = open(garmin->device, O_NOCTTY | O_RDWR);
-	if (garmin->fd == -1)
-		error("open: %s: %s", garmin->device, strerror(errno));
-	if (tcflush(garmin->fd, TCIOFLUSH) == -1)
-		error("tcflush: %s: %s", garmin->device, strerror(errno));
-	struct termios termios;
-	memset(&termios, 0, sizeof termios);
-	termios.c_iflag = IGNPAR;
-	termios.c_cflag = CLOCAL | CREAD | CS8;
-	cfsetispeed(&termios, B9600);
-	cfsetospeed(&termios, B9600);
-	if (tcsetattr(garmin->fd, TCSANOW, &termios) == -1)
-		error("tcsetattr: %s: %s", garmin->device, strerror(errno));
-	garmin->logfile = logfile;
+	garmin_arena_t *arena = garmin_arena_new();
+	garmin_t *garmin = garmin_arena_alloc(arena, sizeof(garmin_t));
+	*garmin = (garmin_t) {
+		.device = transport->name,
+		.transport = transport,
+		.clock = transport->clock,
+		.arena = arena,
+		.log = log,
+		.sent = -1
+	};
 	garmin_packet_t packet;
 	packet.id = Pid_Product_Rqst;
 	packet.size = 0;
 	garmin_write_packet_ack(garmin, &packet);
-	garmin_expect_packet_ack(garmin, &packet, Pid_Product_Data);
-	garmin->product_data = alloc(packet.size + 1);
-	memcpy(garmin->product_data, packet.data, packet.size);
-	((char *) garmin->product_data)[packet.size] = 0;
-	garmin_read_packet_ack(garmin, &packet);
-	if (packet.id == Pid_Ext_Product_Data) {
-		garmin_read_packet_ack(garmin, &packet);
-	} else if (packet.id != EOF) {
-		error("%s: unexpected packet %d", garmin->device, packet.id);
-	}
-	if (packet.id == Pid_Protocol_Array) {
-		garmin->nprotocols = packet.size / sizeof(Protocol_Data_Type);
-		garmin->protocols = alloc(packet.size);
-		memcpy(garmin->protocols, packet.data, packet.size);
-		garmin_read_packet_ack(garmin, &packet);
-	} else if (packet.id != EOF) {
-		error("%s: unexpected packet %d", garmin->device, packet.id);
+	/* The reply is Product_Data, any number of Ext_Product_Data and, on all
+	 * but the oldest devices, the Protocol_Array.  Take packets as they come,
+	 * in whatever order, until both have arrived or, failing the
+	 * Protocol_Array, a pause after Product_Data, all within one deadline.
+	 * The pause must outlast a retransmission, so that a lost packet is not
+	 * mistaken for the end of the reply. */
+	int64_t deadline = garmin->clock->now(garmin->clock) + GARMINI_HANDSHAKE_TIMEOUT;
+	while (!garmin->product_data || !garmin->protocols) {
+		if (garmin_read_packet_ack(garmin, &packet) == EOF) {
+			if (garmin->product_data && garmin->clock->now(garmin->clock) - garmin->received >= GARMINI_PAUSE)
+				break;
+		} else if (packet.id == Pid_Product_Data) {
+			if (!garmin->product_data) {
+				garmin->product_data = garmin_arena_alloc(garmin->arena, packet.size + 1);
+				memcpy(garmin->product_data, packet.data, packet.size);
+				((char *) garmin->product_data)[packet.size] = 0;
+			}
+		} else if (packet.id == Pid_Protocol_Array) {
+			garmin->nprotocols = packet.size / sizeof(Protocol_Data_Type);
+			garmin->protocols = garmin_arena_alloc(garmin->arena, packet.size);
+			memcpy(garmin->protocols, packet.data, packet.size);
+		} else if (packet.id != Pid_Ext_Product_Data) {
+			garmin_warning(garmin, "unexpected packet %d", packet.id);
+		}
+		if (garmin->clock->now(garmin->clock) >= deadline)
+			break;
 	}
-	if (!garmin_grep_protocol(garmin, Tag_Link_Prot_Id, 1))
+	if (!garmin->product_data)
+		error("%s: timeout waiting for packet %d", garmin->device, Pid_Product_Data);
+	/* Devices that predate the Protocol_Array all speak L001 and A010, and
+	 * their track protocol is known from the product id. */
+	if (garmin->protocols && !garmin_grep_protocol(garmin, Tag_Link_Prot_Id, 1))
 		error("%s: device does not support Link Protocol L001", garmin->device);
-	if (!garmin_grep_protocol(garmin, Tag_Appl_Prot_Id, 10))
+	if (garmin->protocols && !garmin_grep_protocol(garmin, Tag_Appl_Prot_Id, 10))
 		error("%s: device does not support Device Command Protocol A010", garmin->device);
 	return garmin;
 }
 
+garmin_t *garmin_new(const char *device, garmin_log_t *log)
+{
+	return garmin_new_transport(garmin_serial_new(device, 0), log);
+}
+
 int garmin_has_barometric_altimeter(garmin_t *garmin)
 {
 	const char *p = garmin->product_data->product_description;
@@ -374,29 +779,173 @@ int garmin_has_barometric_altimeter(garmin_t *garmin)
 void garmin_delete(garmin_t *garmin)
 {
 	if (garmin) {
-		if (close(garmin->fd) == -1)
-			DIE("close", errno);
-		free(garmin->product_data);
-		free(garmin->protocols);
-		free(garmin);
+		garmin->transport->delete(garmin->transport);
+		garmin_arena_delete(garmin->arena);
 	}
 }
 
-void garmin_each(garmin_t *garmin, int command, void (*callback)(void *, int, int, const garmin_packet_t *), void *data)
+/* garmin_each() runs the link in its own thread, which only reads, ACKs and
+ * queues packets.  The callback runs in the calling thread, so a slow consumer
+ * never delays an ACK.  The queue is a single-producer, single-consumer ring;
+ * its only synchronisation is a pair of counting semaphores, which block only
+ * when the ring is empty or, as backpressure, full.  Each packet carries the
+ * time the link thread received it, as the consumer may run far behind. */
+#define GARMIN_QUEUE_SIZE 1024
+
+typedef struct {
+	int i;
+	int records;
+	int64_t received;
+	garmin_packet_t packet;
+} garmin_queue_entry_t;
+
+typedef struct {
+	garmin_t *garmin;
+	int command;
+	sem_t items;
+	sem_t slots;
+	unsigned head;
+	unsigned tail;
+	garmin_queue_entry_t entries[GARMIN_QUEUE_SIZE];
+} garmin_queue_t;
+
+static void garmin_queue_wait(sem_t *sem)
+{
+	while (sem_wait(sem) == -1)
+		if (errno != EINTR)
+			DIE("sem_wait", errno);
+}
+
+static void garmin_queue_push(garmin_queue_t *queue, int i, int records, int64_t received, const garmin_packet_t *packet)
+{
+	garmin_queue_wait(&queue->slots);
+	garmin_queue_entry_t *entry = queue->entries + queue->tail++ % GARMIN_QUEUE_SIZE;
+	entry->i = i;
+	entry->records = records;
+	entry->received = received;
+	if (packet)
+		entry->packet = *packet;
+	if (sem_post(&queue->items) == -1)
+		DIE("sem_post", errno);
+}
+
+static const garmin_queue_entry_t *garmin_queue_front(garmin_queue_t *queue)
+{
+	garmin_queue_wait(&queue->items);
+	return queue->entries + queue->head % GARMIN_QUEUE_SIZE;
+}
+
+static void garmin_queue_pop(garmin_queue_t *queue)
 {
+	++queue->head;
+	if (sem_post(&queue->slots) == -1)
+		DIE("sem_post", errno);
+}
+
+static void *garmin_each_thread(void *data)
+{
+	garmin_queue_t *queue = data;
+	garmin_t *garmin = queue->garmin;
 	garmin_packet_t packet;
 	packet.id = Pid_Command_Data;
 	packet.size = 2;
-	*((uint16_t *) packet.data) = command;
+	*((uint16_t *) packet.data) = queue->command;
 	garmin_write_packet_ack(garmin, &packet);
 	garmin_expect_packet_ack(garmin, &packet, Pid_Records);
 	int records = *((uint16_t *) packet.data);
 	int i;
 	for (i = 0; i < records; ++i) {
-		garmin_read_packet_ack(garmin, &packet);
-		callback(data, i, records, &packet);
+		if (garmin_wait_packet_ack(garmin, &packet) == EOF)
+			error("%s: timeout waiting for record %d of %d", garmin->device, i + 1, records);
+		garmin_queue_push(queue, i, records, garmin->received, &packet);
 	}
 	garmin_expect_packet_ack(garmin, &packet, Pid_Xfer_Cmplt);
+	garmin_queue_push(queue, -1, records, garmin->received, 0);
+	return 0;
+}
+
+void garmin_each(garmin_t *garmin, int command, void (*callback)(void *, int, int, int64_t, const garmin_packet_t *), void *data)
+{
+	garmin_queue_t *queue = alloc(sizeof(garmin_queue_t));
+	queue->garmin = garmin;
+	queue->command = command;
+	if (sem_init(&queue->items, 0, 0) == -1)
+		DIE("sem_init", errno);
+	if (sem_init(&queue->slots, 0, GARMIN_QUEUE_SIZE) == -1)
+		DIE("sem_init", errno);
+	pthread_t thread;
+	int rc = pthread_create(&thread, 0, garmin_each_thread, queue);
+	if (rc)
+		DIE("pthread_create", rc);
+	while (1) {
+		const garmin_queue_entry_t *entry = garmin_queue_front(queue);
+		if (entry->i == -1)
+			break;
+		callback(data, entry->i, entry->records, entry->received, &entry->packet);
+		garmin_queue_pop(queue);
+	}
+	rc = pthread_join(thread, 0);
+	if (rc)
+		DIE("pthread_join", rc);
+	sem_destroy(&queue->items);
+	sem_destroy(&queue->slots);
+	free(queue);
+}
+
+/* Measures the link with repeated product requests, the same exchange as the
+ * handshake, and then starts a track log transfer only to learn its length,
+ * aborting it at once.  Whatever the device still sends is acknowledged and
+ * dropped until it falls silent or completes the transfer.  A reply ends with
+ * the Protocol_Array or, from a device that sent none in the handshake, with
+ * the last packet before the link falls silent after Product_Data. */
+void garmin_linktest(garmin_t *garmin, int exchanges, garmin_linktest_t *linktest)
+{
+	memset(linktest, 0, sizeof *linktest);
+	int64_t bytes = garmin->bytes_read + garmin->bytes_written;
+	int last = garmin->protocols ? Pid_Protocol_Array : Pid_Product_Data;
+	garmin_packet_t packet;
+	int i;
+	for (i = 0; i < exchanges; ++i) {
+		int64_t sent = garmin->clock->now(garmin->clock);
+		packet.id = Pid_Product_Rqst;
+		packet.size = 0;
+		garmin_write_packet_ack(garmin, &packet);
+		++linktest->packets;
+		int64_t deadline = sent + GARMINI_HANDSHAKE_TIMEOUT;
+		int rc;
+		while ((rc = garmin_read_packet_ack(garmin, &packet)) != last) {
+			if (rc != EOF)
+				++linktest->packets;
+			if (garmin->clock->now(garmin->clock) >= deadline)
+				error("%s: timeout waiting for packet %d", garmin->device, last);
+		}
+		++linktest->packets;
+		if (!garmin->protocols)
+			while (garmin_read_packet_ack(garmin, &packet) != EOF)
+				++linktest->packets;
+		garmin_latency_record(&linktest->exchanges, garmin->received - sent);
+	}
+	linktest->elapsed = linktest->exchanges.total;
+	linktest->bytes = garmin->bytes_read + garmin->bytes_written - bytes;
+	packet.id = Pid_Command_Data;
+	packet.size = 2;
+	*((uint16_t *) packet.data) = Cmnd_Transfer_Trk;
+	garmin_write_packet_ack(garmin, &packet);
+	garmin_expect_packet_ack(garmin, &packet, Pid_Records);
+	linktest->records = *((uint16_t *) packet.data);
+	packet.id = Pid_Command_Data;
+	packet.size = 2;
+	*((uint16_t *) packet.data) = Cmnd_Abort_Transfer;
+	garmin_write_packet(garmin, &packet);
+	while (garmin_read_packet(garmin, &packet) != EOF) {
+		if (packet.id == Pid_Ack_Byte || packet.id == Pid_Nak_Byte || garmin->transport->read_packet)
+			continue;
+		garmin_packet_t ack;
+		garmin_ack(garmin, &packet, &ack);
+		garmin_log_packet(garmin, &ack, '>');
+		if (packet.id == Pid_Xfer_Cmplt)
+			break;
+	}
 }
 
 void garmin_turn_off_pwr(garmin_t *garmin)
@@ -412,11 +961,11 @@ typedef struct {
 	garmin_t *garmin;
 	Protocol_Data_Type trk_hdr;
 	Protocol_Data_Type trk_data;
-	void (*callback)(void *, const garmin_trk_point_t *, int, int);
+	void (*callback)(void *, const garmin_trk_point_t *, int, int, int64_t);
 	void *data;
 } garmin_transfer_trk_data_t;
 
-static void garmin_transfer_trk_callback(void *data, int i, int records, const garmin_packet_t *packet)
+static void garmin_transfer_trk_callback(void *data, int i, int records, int64_t received, const garmin_packet_t *packet)
 {
 	garmin_transfer_trk_data_t *transfer_trk_data = data;
 	switch (packet->id) {
@@ -431,7 +980,7 @@ static void garmin_transfer_trk_callback(void *data, int i, int records, const g
 							trk_point.posn = d300_trk_point->posn;
 							trk_point.time = d300_trk_point->time;
 							trk_point.alt = 0;
-							trk_point.validity = 'V';
+							trk_point.valid = 0;
 						}
 						break;
 					case 301:
@@ -440,7 +989,7 @@ static void garmin_transfer_trk_callback(void *data, int i, int records, const g
 							trk_point.posn = d301_trk_point->posn;
 							trk_point.time = d301_trk_point->time;
 							trk_point.alt = d301_trk_point->alt;
-							trk_point.validity = 'A';
+							trk_point.valid = 1;
 						}
 						break;
 					case 302:
@@ -449,7 +998,7 @@ static void garmin_transfer_trk_callback(void *data, int i, int records, const g
 							trk_point.posn = d302_trk_point->posn;
 							trk_point.time = d302_trk_point->time;
 							trk_point.alt = d302_trk_point->alt;
-							trk_point.validity = 'A';
+							trk_point.valid = 1;
 						}
 						break;
 					case 303:
@@ -458,7 +1007,7 @@ static void garmin_transfer_trk_callback(void *data, int i, int records, const g
 							trk_point.posn = d303_trk_point->posn;
 							trk_point.time = d303_trk_point->time;
 							trk_point.alt = d303_trk_point->alt;
-							trk_point.validity = 'A';
+							trk_point.valid = 1;
 						}
 						break;
 					case 304:
@@ -467,14 +1016,14 @@ static void garmin_transfer_trk_callback(void *data, int i, int records, const g
 							trk_point.posn = d304_trk_point->posn;
 							trk_point.time = d304_trk_point->time;
 							trk_point.alt = d304_trk_point->alt;
-							trk_point.validity = 'A';
+							trk_point.valid = 1;
 						}
 						break;
 					default:
 						abort();
 						break;
 				}
-				transfer_trk_data->callback(transfer_trk_data->data, &trk_point, i, records);
+				transfer_trk_data->callback(transfer_trk_data->data, &trk_point, i, records, received);
 				break;
 			}
 		case Pid_Trk_Hdr:
@@ -482,7 +1031,7 @@ static void garmin_transfer_trk_callback(void *data, int i, int records, const g
 	}
 }
 
-void garmin_transfer_trk(garmin_t *garmin, void (*callback)(void *, const garmin_trk_point_t *, int, int), void *data)
+void garmin_transfer_trk(garmin_t *garmin, void (*callback)(void *, const garmin_trk_point_t *, int, int, int64_t), void *data)
 {
 	garmin_transfer_trk_data_t transfer_trk_data;
 	memset(&transfer_trk_data, 0, sizeof transfer_trk_data);
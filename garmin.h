@@ -25,7 +25,11 @@
 #include <stdio.h>
 #include <sys/types.h>
 
+#include "arena.h"
+#include "log.h"
+
 #define GARMIN_TIME_OFFSET 631065600
+#define GARMIN_FRAME_SIZE (2 * (2 + 255 + 1) + 3)
 
 #define DIE(syscall, _errno) die(__FILE__, __LINE__, __FUNCTION__, (syscall), (_errno))
 
@@ -35,6 +39,11 @@ typedef struct {
 	unsigned char data[255];
 } garmin_packet_t;
 
+enum {
+	Pid_Ack_Byte =  6,
+	Pid_Nak_Byte = 21
+};
+
 typedef struct {
 	uint16_t product_id;
 	int16_t software_version;
@@ -51,36 +60,126 @@ typedef struct {
 	int32_t lon;
 } position_t;
 
+/* Track points are kept packed in 16 bytes so that a long track log stays
+ * cache friendly through every stage.  time is the Garmin time in seconds,
+ * which fits in 31 bits until January 2058, and valid is the IGC fix
+ * validity: set when the point came with an altitude (D301 and later), clear
+ * for D300.  The bitfield promotes to int, so convert it with
+ * garmin_unix_time() rather than by adding GARMIN_TIME_OFFSET, which would
+ * overflow from 2038. */
 typedef struct {
-	time_t time;
+	uint32_t time : 31;
+	uint32_t valid : 1;
 	position_t posn;
 	float alt;
-	char validity;
 } garmin_trk_point_t;
 
+_Static_assert(sizeof(garmin_trk_point_t) == 16, "garmin_trk_point_t must pack into 16 bytes");
+
+/* Times are in microseconds.  The real clock is monotonic wall time and sleep()
+ * really sleeps; a virtual clock only moves when something sleeps on it, and
+ * then jumps ahead at once, so replays neither wait out timeouts nor depend on
+ * the speed of the host. */
+typedef struct garmin_clock garmin_clock_t;
+
+struct garmin_clock {
+	int64_t (*now)(garmin_clock_t *);
+	void (*sleep)(garmin_clock_t *, int64_t);
+	int64_t time;
+};
+
+extern garmin_clock_t garmin_real_clock;
+
+/* A transport moves bytes to and from a device.  read() waits at most timeout
+ * microseconds, measured on the transport's clock, and returns 0 if nothing
+ * arrived.  A packet transport, such as USB, frames packets itself and has no
+ * link level ACKs: it sets read_packet() and write_packet() instead, and
+ * read_packet() returns EOF if nothing arrived.  baud is the speed of the serial
+ * line behind the transport, or 0 where there is none. */
+typedef struct garmin_transport garmin_transport_t;
+
+struct garmin_transport {
+	int (*read)(garmin_transport_t *, unsigned char *, int, int64_t);
+	void (*write)(garmin_transport_t *, const unsigned char *, int);
+	void (*delete)(garmin_transport_t *);
+	int (*read_packet)(garmin_transport_t *, garmin_packet_t *, int64_t);
+	void (*write_packet)(garmin_transport_t *, const garmin_packet_t *);
+	const char *name;
+	garmin_clock_t *clock;
+	int baud;
+};
+
+/* Round trip times in microseconds; bucket i counts those in [2^i, 2^(i+1)),
+ * with bucket 0 also counting zero. */
+#define GARMIN_LATENCY_BUCKETS 24
+
+typedef struct {
+	int count;
+	int64_t total;
+	int64_t min;
+	int64_t max;
+	int buckets[GARMIN_LATENCY_BUCKETS];
+} garmin_latency_t;
+
+/* The result of a link test: exchanges holds the time from each product
+ * request to the last packet of its reply, elapsed their sum, and bytes,
+ * including framing and ACKs, and packets, ACKs excluded, cover all the
+ * exchanges. */
+typedef struct {
+	garmin_latency_t exchanges;
+	int packets;
+	int64_t bytes;
+	int64_t elapsed;
+	int records;
+} garmin_linktest_t;
+
 typedef struct {
 	const char *device;
-	int fd;
-	FILE *logfile;
+	garmin_transport_t *transport;
+	garmin_clock_t *clock;
+	garmin_arena_t *arena;
+	garmin_log_t *log;
 	Product_Data_Type *product_data;
 	int nprotocols;
 	Protocol_Data_Type *protocols;
 	unsigned char *next;
 	unsigned char *end;
+	int64_t sent;
+	int64_t received;
+	int64_t bytes_read;
+	int64_t bytes_written;
+	garmin_latency_t latency;
+	garmin_latency_t turnaround;
+	garmin_packet_t last;
+	int has_last;
+	int64_t acked;
+	garmin_packet_t pending;
+	int has_pending;
+	int failures;
+	int naks;
+	int retransmissions;
+	int duplicates;
 	unsigned char buf[1024];
 } garmin_t;
 
+time_t garmin_unix_time(uint32_t);
+int garmin_frame_packet(const garmin_packet_t *, unsigned char *);
 int garmin_read_packet(garmin_t *, garmin_packet_t *);
 void garmin_write_packet(garmin_t *, garmin_packet_t *);
 int garmin_read_packet_ack(garmin_t *, garmin_packet_t *);
 int garmin_expect_packet_ack(garmin_t *, garmin_packet_t *, int);
 void garmin_write_packet_ack(garmin_t *, garmin_packet_t *);
 Protocol_Data_Type *garmin_grep_protocol(garmin_t *, int, int);
-garmin_t *garmin_new(const char *, FILE *);
+void garmin_clock_init_virtual(garmin_clock_t *);
+garmin_transport_t *garmin_serial_new(const char *, const char *);
+void garmin_serial_report(garmin_transport_t *, FILE *);
+garmin_t *garmin_new_transport(garmin_transport_t *, garmin_log_t *);
+garmin_t *garmin_new(const char *, garmin_log_t *);
 int garmin_has_barometric_altimeter(garmin_t *);
 void garmin_delete(garmin_t *);
-void garmin_each(garmin_t *, int, void (*)(void *, int, int, const garmin_packet_t *), void *);
+void garmin_each(garmin_t *, int, void (*)(void *, int, int, int64_t, const garmin_packet_t *), void *);
 void garmin_turn_off_pwr(garmin_t *);
-void garmin_transfer_trk(garmin_t *, void (*)(void *, const garmin_trk_point_t *, int, int), void *);
+void garmin_linktest(garmin_t *, int, garmin_linktest_t *);
+void garmin_transfer_trk(garmin_t *, void (*)(void *, const garmin_trk_point_t *, int, int, int64_t), void *);
 
 #endif
@@ -25,26 +25,37 @@
 #include <float.h>
 #include <getopt.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/times.h>
 #include <time.h>
+#include <sys/resource.h>
 #include <unistd.h>
 
+#include "archive.h"
+#include "cpu.h"
+#include "faults.h"
 #include "garmin.h"
+#include "gzip.h"
+#include "output.h"
+#include "replay.h"
+#include "sha256.h"
+#include "tcp.h"
+#include "track.h"
+#include "usb.h"
 
 #ifndef DEVICE
 #define DEVICE "/dev/ttyS0"
 #endif
 
 const char *program_name = 0;
-int _sc_clk_tck = -1;
 const char *device = 0;
-FILE *logfile = 0;
+const char *logfile = 0;
 const char *directory = 0;
+const char *archive_filename = 0;
 int power_off = 0;
 const char *manufacturer = "XXX";
 int serial_number = 0;
@@ -55,15 +66,62 @@ const char *pilot = 0;
 const char *competition_class = 0;
 const char *competition_id = 0;
 int quiet = 0;
+int summary = 0;
+int g_record = 0;
+const char *g_record_key = 0;
+int io_uring = 0;
+int durability = GARMINI_DURABILITY_NONE;
+int gzip = 0;
+int progress_fd = -1;
+const char *faults = 0;
+const char *serial = 0;
+int stats = 0;
 
+enum {
+	SMOOTH_NONE,
+	SMOOTH_ANALYSIS,
+	SMOOTH_OUTPUT
+};
+
+int smooth = SMOOTH_NONE;
+
+/* A session is one device and what the commands have learned from it.  Each
+ * -d or -r option adds one; with more than one they run concurrently, one
+ * thread each, and session i takes serial number serial_number + i. */
+typedef struct {
+	const char *device;
+	int replay;
+	char *json_device;
+	garmin_transport_t *transport;
+	garmin_transport_t *faults;
+	garmin_log_t *log;
+	garmin_t *garmin;
+	garmini_track_t *track;
+	int serial_number;
+	int barometric_altimeter;
+	int64_t start;
+	int64_t finish;
+	pthread_t thread;
+} garmini_session_t;
+
+static int concurrent = 0;
+static garmini_archive_t *archive = 0;
+
+/* Only the first error runs the exit handlers.  Any later one, from another
+ * session or from an exit handler itself, could wait forever for the first
+ * to finish, so it ends the process at once with _exit(). */
 void error(const char *message, ...)
 {
+	static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+	int first = pthread_mutex_trylock(&mutex) == 0;
 	fprintf(stderr, "%s: ", program_name);
 	va_list ap;
 	va_start(ap, message);
 	vfprintf(stderr, message, ap);
 	va_end(ap);
 	fprintf(stderr, "\n");
+	if (!first)
+		_exit(EXIT_FAILURE);
 	exit(EXIT_FAILURE);
 }
 
@@ -94,168 +152,232 @@ void *alloc(int size)
 	return p;
 }
 
+/* Escapes c as in a C string into buf, which must hold at least five bytes,
+ * and returns the length of the escape. */
+int format_char(char *buf, int c)
+{
+	const char *format;
+	switch (c) {
+		case '\a':
+			format = "\\a";
+			break;
+		case '\b':
+			format = "\\b";
+			break;
+		case '\f':
+			format = "\\f";
+			break;
+		case '\n':
+			format = "\\n";
+			break;
+		case '\r':
+			format = "\\r";
+			break;
+		case '\t':
+			format = "\\t";
+			break;
+		case '\v':
+			format = "\\v";
+			break;
+		case '\"':
+			format = "\\\"";
+			break;
+		case '\\':
+			format = "\\\\";
+			break;
+		default:
+			format = isprint(c) ? "%c" : "\\x%02x";
+			break;
+	}
+	return sprintf(buf, format, ((unsigned) c) & 0xff);
+}
+
 void print_string(FILE *file, const char *s, int len)
 {
 	const char *end = s + (len < 0 ? (int) strlen(s) : len);
 	const char *p;
 	for (p = s; p < end; ++p) {
-		const char *format;
-		switch (*p) {
-			case '\a':
-				format = "\\a";
-				break;
-			case '\b':
-				format = "\\b";
-				break;
-			case '\f':
-				format = "\\f";
-				break;
-			case '\n':
-				format = "\\n";
-				break;
-			case '\r':
-				format = "\\r";
-				break;
-			case '\t':
-				format = "\\t";
-				break;
-			case '\v':
-				format = "\\v";
-				break;
-			case '\"':
-				format = "\\\"";
-				break;
-			default:
-				format = isprint(*p) ? "%c" : "\\x%02x";
-				break;
-		}
-		fprintf(file, format, ((unsigned) *p) & 0xff);
+		char buf[5];
+		fwrite(buf, 1, format_char(buf, (unsigned char) *p), file);
 	}
 }
 
+/* Progress is updated on a tick rather than for every record: only every
+ * GARMINI_PROGRESS_RECORDS records, and the display only changes once
+ * GARMINI_PROGRESS_INTERVAL has passed.  Times are those at which the link
+ * received the records, not when they are consumed, so that a replay always
+ * shows the same progress.  The ETA comes from an
+ * exponentially weighted moving average of the throughput between ticks, so
+ * that it settles quickly but does not jump with every slow packet. */
+#define GARMINI_PROGRESS_RECORDS 16
+#define GARMINI_PROGRESS_INTERVAL (250 * 1000)
+#define GARMINI_PROGRESS_ALPHA 0.3
+
 typedef struct {
-	int capacity;
-	garmin_trk_point_t *begin;
-	garmin_trk_point_t *end;
-} garmini_track_t;
+	garmini_session_t *session;
+	garmini_track_t *track;
+	int64_t start;
+	int64_t received;
+	int64_t tick;
+	int tick_records;
+	int records;
+	double rate;
+} garmini_transfer_trk_data_t;
 
-garmini_track_t *garmini_track_new(int capacity)
+static void garmini_progress(garmini_transfer_trk_data_t *transfer_trk_data, int64_t now, int done, int records, double eta)
 {
-	garmini_track_t *track = alloc(sizeof(garmini_track_t));
-	track->capacity = capacity;
-	track->begin = alloc(track->capacity * sizeof(garmin_trk_point_t));
-	track->end = track->begin;
-	return track;
+	double elapsed = (now - transfer_trk_data->start) / 1e6;
+	if (!quiet && !concurrent) {
+		int remaining_sec = eta + 0.5;
+		if (done == records)
+			fprintf(stderr, "\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b100%%  %02d:%02d    \n", (int) elapsed / 60, (int) elapsed % 60);
+		else
+			fprintf(stderr, "\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b%3d%%  %02d:%02d ETA", 100 * done / records, remaining_sec / 60, remaining_sec % 60);
+	}
+	if (progress_fd != -1)
+		dprintf(progress_fd, "{\"device\":%s,\"done\":%d,\"total\":%d,\"elapsed\":%.2f,\"eta\":%.1f,\"rate\":%.1f}\n", transfer_trk_data->session->json_device, done, records, elapsed, eta, transfer_trk_data->rate);
 }
 
-void garmini_track_delete(garmini_track_t *track)
+static void garmini_transfer_trk_callback(void *data, const garmin_trk_point_t *trk_point, int i, int records, int64_t received)
 {
-	if (track) {
-		if (track->capacity)
-			free(track->begin);
-		free(track);
-	}
+	garmini_transfer_trk_data_t *transfer_trk_data = data;
+	garmini_track_push(transfer_trk_data->track, trk_point);
+	transfer_trk_data->records = records;
+	transfer_trk_data->received = received;
+	if (((quiet || concurrent) && progress_fd == -1) || (i + 1) % GARMINI_PROGRESS_RECORDS)
+		return;
+	int64_t interval = received - transfer_trk_data->tick;
+	if (interval < GARMINI_PROGRESS_INTERVAL)
+		return;
+	double rate = (i + 1 - transfer_trk_data->tick_records) * 1e6 / interval;
+	if (transfer_trk_data->tick_records)
+		rate = GARMINI_PROGRESS_ALPHA * rate + (1 - GARMINI_PROGRESS_ALPHA) * transfer_trk_data->rate;
+	transfer_trk_data->rate = rate;
+	transfer_trk_data->tick = received;
+	transfer_trk_data->tick_records = i + 1;
+	garmini_progress(transfer_trk_data, received, i + 1, records, (records - i - 1) / rate);
 }
 
-void garmini_track_push(garmini_track_t *track, const garmin_trk_point_t *trk_point)
+garmini_track_t *garmini_transfer_trk(garmini_session_t *session)
 {
-	if (track->end - track->begin == track->capacity) {
-		int old_capacity = track->capacity;
-		track->capacity *= 2;
-		track->begin = realloc(track->begin, track->capacity * sizeof(garmin_trk_point_t));
-		if (!track->begin)
-			DIE("realloc", errno);
-		track->end = track->begin + old_capacity;
-	}
-	*track->end++ = *trk_point;
+	garmin_t *garmin = session->garmin;
+	garmini_transfer_trk_data_t transfer_trk_data;
+	memset(&transfer_trk_data, 0, sizeof transfer_trk_data);
+	transfer_trk_data.session = session;
+	transfer_trk_data.track = garmini_track_new(garmin->arena, 16384);
+	transfer_trk_data.start = transfer_trk_data.tick = transfer_trk_data.received = garmin->clock->now(garmin->clock);
+	if (!quiet && !concurrent)
+		fprintf(stderr, "%s: downloading track log:   0%%  00:00 ETA", program_name);
+	garmin_transfer_trk(garmin, garmini_transfer_trk_callback, &transfer_trk_data);
+	/* The last record may already have been reported on a tick. */
+	if (!transfer_trk_data.tick_records || transfer_trk_data.tick_records != transfer_trk_data.records)
+		garmini_progress(&transfer_trk_data, transfer_trk_data.received, transfer_trk_data.records, transfer_trk_data.records, 0);
+	return transfer_trk_data.track;
 }
 
 typedef struct {
-	garmini_track_t *track;
-	clock_t clock;
-	int remaining_sec;
-	int percentage;
-} garmini_transfer_trk_data_t;
+	garmini_buffer_t *buffer;
+	sha256_t sha256;
+	hmac_sha256_t hmac;
+} garmini_igc_t;
 
-static void garmini_transfer_trk_callback(void *data, const garmin_trk_point_t *trk_point, int i, int records)
+static void garmini_igc_printf(garmini_igc_t *igc, const char *format, ...)
 {
-	garmini_transfer_trk_data_t *transfer_trk_data = data;
-	if (!quiet) {
-		struct tms tms;
-		clock_t clock = times(&tms);
-		if (clock == -1)
-			DIE("times", errno);
-		int remaining_sec = (records - i - 1) * (clock - transfer_trk_data->clock) / (_sc_clk_tck * (i + 1));
-		if (remaining_sec < 1)
-			remaining_sec = 1;
-		int percentage = 100 * i / records;
-		if (remaining_sec != transfer_trk_data->remaining_sec || percentage != transfer_trk_data->percentage) {
-			fprintf(stderr, "\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b%3d%%  %02d:%02d ETA", 100 * i / records, remaining_sec / 60, remaining_sec % 60);
-			transfer_trk_data->remaining_sec = remaining_sec;
-			transfer_trk_data->percentage = percentage;
-		}
-	}
-	garmini_track_push(transfer_trk_data->track, trk_point);
+	va_list ap;
+	va_start(ap, format);
+	size_t size = igc->buffer->size;
+	garmini_buffer_vprintf(igc->buffer, format, ap);
+	va_end(ap);
+	const char *line = igc->buffer->data + size;
+	size_t n = igc->buffer->size - size;
+	if (g_record_key)
+		hmac_sha256_update(&igc->hmac, line, n);
+	else if (g_record)
+		sha256_update(&igc->sha256, line, n);
 }
 
-garmini_track_t *garmini_transfer_trk(garmin_t *garmin)
+/* The G record is the SHA-256 digest, or with a key the HMAC-SHA256, of every
+ * byte written before it, computed as the lines are formatted. */
+static void garmini_igc_write_g_record(garmini_igc_t *igc)
 {
-	garmini_transfer_trk_data_t transfer_trk_data;
-	memset(&transfer_trk_data, 0, sizeof transfer_trk_data);
-	transfer_trk_data.track = garmini_track_new(16384);
-	if (!quiet) {
-		if (_sc_clk_tck == -1) {
-			_sc_clk_tck = sysconf(_SC_CLK_TCK);
-			if (_sc_clk_tck == -1)
-				DIE("sysconf", errno);
-		}
-		struct tms tms;
-		transfer_trk_data.clock = times(&tms);
-		if (transfer_trk_data.clock == -1)
-			DIE("times", errno);
-		transfer_trk_data.remaining_sec = -1;
-		transfer_trk_data.percentage = -1;
-		fprintf(stderr, "%s: downloading track log:   0%%  00:00 ETA", program_name);
-	}
-	garmin_transfer_trk(garmin, garmini_transfer_trk_callback, &transfer_trk_data);
-	if (!quiet) {
-		struct tms tms;
-		clock_t clock = times(&tms);
-		int total_sec = (clock - transfer_trk_data.clock) / _sc_clk_tck;
-		fprintf(stderr, "\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b100%%  %02d:%02d    \n", total_sec / 60, total_sec % 60);
+	unsigned char digest[SHA256_DIGEST_SIZE];
+	if (g_record_key)
+		hmac_sha256_final(&igc->hmac, digest);
+	else
+		sha256_final(&igc->sha256, digest);
+	int i;
+	for (i = 0; i < SHA256_DIGEST_SIZE; ++i) {
+		if (i % 16 == 0)
+			garmini_buffer_printf(igc->buffer, "G");
+		garmini_buffer_printf(igc->buffer, "%02X", digest[i]);
+		if (i % 16 == 15)
+			garmini_buffer_printf(igc->buffer, "\r\n");
 	}
-	return transfer_trk_data.track;
 }
 
-void garmini_write_igc(FILE *file, garmin_t *garmin, const garmin_trk_point_t *begin, const garmin_trk_point_t *end)
+/* B records have a fixed width, so the size of an IGC file is known to within
+ * the number of date changes before it is formatted. */
+#define GARMINI_IGC_HEADER_SIZE 512
+#define GARMINI_IGC_HFDTE_SIZE 13
+#define GARMINI_IGC_B_SIZE 37
+#define GARMINI_IGC_G_SIZE 70
+
+size_t garmini_igc_size(garmini_session_t *session, const garmin_trk_point_t *begin, const garmin_trk_point_t *end)
 {
-	fprintf(file, "A%s%03d\r\n", manufacturer, serial_number);
-	time_t time = (begin == end ? 0 : begin->time) + GARMIN_TIME_OFFSET;
-	struct tm *tm = gmtime(&time);
-	fprintf(file, "HFDTE%02d%02d%02d\r\n", tm->tm_mday, tm->tm_mon + 1, (tm->tm_year + 1900) % 100);
+	garmin_t *garmin = session->garmin;
+	size_t size = GARMINI_IGC_HEADER_SIZE + strlen(manufacturer) + strlen(garmin->product_data->product_description);
+	const char *strings[] = { pilot, glider_type, glider_id, competition_id, competition_class };
+	unsigned i;
+	for (i = 0; i < sizeof strings / sizeof strings[0]; ++i)
+		if (strings[i])
+			size += strlen(strings[i]);
+	if (begin != end)
+		size += GARMINI_IGC_HFDTE_SIZE * ((end[-1].time - begin->time) / 86400 + 1);
+	size += GARMINI_IGC_B_SIZE * (end - begin);
+	if (g_record)
+		size += GARMINI_IGC_G_SIZE;
+	return size;
+}
+
+void garmini_write_igc(garmini_buffer_t *buffer, garmini_session_t *session, const garmin_trk_point_t *begin, const garmin_trk_point_t *end)
+{
+	garmin_t *garmin = session->garmin;
+	garmini_buffer_reserve(buffer, garmini_igc_size(session, begin, end));
+	garmini_igc_t igc;
+	igc.buffer = buffer;
+	if (g_record_key)
+		hmac_sha256_init(&igc.hmac, g_record_key, strlen(g_record_key));
+	else if (g_record)
+		sha256_init(&igc.sha256);
+	garmini_igc_printf(&igc, "A%s%03d\r\n", manufacturer, session->serial_number);
+	time_t time = garmin_unix_time(begin == end ? 0 : begin->time);
+	struct tm tm_buf;
+	struct tm *tm = gmtime_r(&time, &tm_buf);
+	garmini_igc_printf(&igc, "HFDTE%02d%02d%02d\r\n", tm->tm_mday, tm->tm_mon + 1, (tm->tm_year + 1900) % 100);
 	struct tm last_tm = *tm;
-	fprintf(file, "HFFXA100\r\n");
+	garmini_igc_printf(&igc, "HFFXA100\r\n");
 	if (pilot)
-		fprintf(file, "HPPLTPILOT:%s\r\n", pilot);
+		garmini_igc_printf(&igc, "HPPLTPILOT:%s\r\n", pilot);
 	if (glider_type)
-		fprintf(file, "HPGTYGLIDERTYPE:%s\r\n", glider_type);
+		garmini_igc_printf(&igc, "HPGTYGLIDERTYPE:%s\r\n", glider_type);
 	if (glider_id)
-		fprintf(file, "HPGIDGLIDERID:%s\r\n", glider_id);
-	fprintf(file, "HDTM100GPSDATUM:WGS-1984\r\n");
-	fprintf(file, "HFRFWFIRMWAREREVISION:%d.%02d\r\n", garmin->product_data->software_version / 100, garmin->product_data->software_version % 100);
-	fprintf(file, "HFFTYFRTYPE:GARMIN,%s\r\n", garmin->product_data->product_description);
+		garmini_igc_printf(&igc, "HPGIDGLIDERID:%s\r\n", glider_id);
+	garmini_igc_printf(&igc, "HDTM100GPSDATUM:WGS-1984\r\n");
+	garmini_igc_printf(&igc, "HFRFWFIRMWAREREVISION:%d.%02d\r\n", garmin->product_data->software_version / 100, garmin->product_data->software_version % 100);
+	garmini_igc_printf(&igc, "HFFTYFRTYPE:GARMIN,%s\r\n", garmin->product_data->product_description);
 	if (competition_id)
-		fprintf(file, "HPCIDCOMPETITIONID:%s\r\n", competition_id);
+		garmini_igc_printf(&igc, "HPCIDCOMPETITIONID:%s\r\n", competition_id);
 	if (competition_class)
-		fprintf(file, "HPCCLCOMPETITIONCLASS:%s\r\n", competition_class);
+		garmini_igc_printf(&igc, "HPCCLCOMPETITIONCLASS:%s\r\n", competition_class);
 	const garmin_trk_point_t *trk_point;
 	for (trk_point = begin; trk_point != end; ++trk_point) {
 		if ((trk_point->posn.lat == 0x7fffffff && trk_point->posn.lon == 0x7fffffff) || trk_point->alt == 1.0e25)
 			continue;
-		time = trk_point->time + GARMIN_TIME_OFFSET;
-		struct tm *tm = gmtime(&time);
+		time = garmin_unix_time(trk_point->time);
+		struct tm tm_buf;
+		struct tm *tm = gmtime_r(&time, &tm_buf);
 		if (tm->tm_year != last_tm.tm_year || tm->tm_mon != last_tm.tm_mon || tm->tm_mday != last_tm.tm_mday) {
-			fprintf(file, "HFDTE%02d%02d%02d\r\n", tm->tm_mday, tm->tm_mon + 1, (tm->tm_year + 1900) % 100);
+			garmini_igc_printf(&igc, "HFDTE%02d%02d%02d\r\n", tm->tm_mday, tm->tm_mon + 1, (tm->tm_year + 1900) % 100);
 			last_tm = *tm;
 		}
 		double lat = fabs(180.0 * trk_point->posn.lat / 2147483648.0) + 0.5 / 60000.0;
@@ -263,19 +385,23 @@ void garmini_write_igc(FILE *file, garmin_t *garmin, const garmin_trk_point_t *b
 		int int_alt = trk_point->alt <= 0.0 ? 0 : trk_point->alt + 0.5;
 		int pressure_alt;
 		int gnss_alt;
-		if (barometric_altimeter) {
+		if (session->barometric_altimeter) {
 			pressure_alt = int_alt;
 			gnss_alt = 0;
 		} else {
 			pressure_alt = 0;
 			gnss_alt = int_alt;
 		}
-		fprintf(file, "B%02d%02d%02d%02d%05d%c%03d%05d%c%c%05d%05d\r\n", tm->tm_hour, tm->tm_min, tm->tm_sec, (int) lat, (int) (60000 * (lat - (int) lat)), trk_point->posn.lat > 0 ? 'N' : 'S', (int) lon, (int) (60000 * (lon - (int) lon)), trk_point->posn.lon > 0 ? 'E' : 'W', trk_point->validity, pressure_alt, gnss_alt);
+		garmini_igc_printf(&igc, "B%02d%02d%02d%02d%05d%c%03d%05d%c%c%05d%05d\r\n", tm->tm_hour, tm->tm_min, tm->tm_sec, (int) lat, (int) (60000 * (lat - (int) lat)), trk_point->posn.lat > 0 ? 'N' : 'S', (int) lon, (int) (60000 * (lon - (int) lon)), trk_point->posn.lon > 0 ? 'E' : 'W', trk_point->valid ? 'A' : 'V', pressure_alt, gnss_alt);
 	}
+	if (g_record)
+		garmini_igc_write_g_record(&igc);
 }
 
-void garmini_id(garmin_t *garmin)
+void garmini_id(garmini_session_t *session)
 {
+	garmin_t *garmin = session->garmin;
+	flockfile(stdout);
 	printf("--- \n");
 	printf("product_id: %d\n", garmin->product_data->product_id);
 	printf("software_version: %d.%02d\n", garmin->product_data->software_version / 100, garmin->product_data->software_version % 100);
@@ -290,30 +416,88 @@ void garmini_id(garmin_t *garmin)
 			printf(",%c%03d", garmin->protocols[i].tag, garmin->protocols[i].data);
 	}
 	printf("\"\n");
+	funlockfile(stdout);
 }
 
-void garmini_igc(garmin_t *garmin)
+/* The track log is transferred at most once per session, by the first command
+ * that needs it, and smoothed then if asked; later commands reuse it. */
+static garmini_track_t *garmini_track(garmini_session_t *session)
 {
-	garmini_track_t *track = garmini_transfer_trk(garmin);
-	garmini_write_igc(stdout, garmin, track->begin, track->end);
-	garmini_track_delete(track);
+	if (!session->track) {
+		session->track = garmini_transfer_trk(session);
+		if (smooth == SMOOTH_OUTPUT)
+			garmini_track_smooth(session->track);
+	}
+	return session->track;
 }
 
-double garmini_distance_fai(const garmin_trk_point_t *trk_point1, const garmin_trk_point_t *trk_point2)
+void garmini_igc(garmini_session_t *session)
 {
-	double lat1 = M_PI * trk_point1->posn.lat / 2147483648.0;
-	double lon1 = M_PI * trk_point1->posn.lon / 2147483648.0;
-	double lat2 = M_PI * trk_point2->posn.lat / 2147483648.0;
-	double lon2 = M_PI * trk_point2->posn.lon / 2147483648.0;
-	double d = sin(lat1) * sin(lat2) + cos(lat1) * cos(lat2) * cos(lon2 - lon1);
-	return d < 1.0 ? 6371000.0 * acos(d) : 0.0;
+	garmini_track_t *track = garmini_track(session);
+	garmini_buffer_t buffer;
+	garmini_buffer_init(&buffer);
+	garmini_write_igc(&buffer, session, track->begin, track->end);
+	if (gzip) {
+		garmini_buffer_t compressed;
+		garmini_buffer_init(&compressed);
+		gzip_buffer(&compressed, buffer.data, buffer.size);
+		free(buffer.data);
+		buffer = compressed;
+	}
+	if (fwrite(buffer.data, 1, buffer.size, stdout) != buffer.size)
+		DIE("fwrite", errno);
+	free(buffer.data);
 }
 
-void garmini_download(garmin_t *garmin)
+static void print_json_string(FILE *file, const char *s)
 {
-	if (directory && chdir(directory) == -1)
-		error("chdir: %s: %s", directory, strerror(errno));
-	garmini_track_t *track = garmini_transfer_trk(garmin);
+	fputc('"', file);
+	for (; *s; ++s) {
+		if (*s == '"' || *s == '\\')
+			fprintf(file, "\\%c", *s);
+		else if ((unsigned char) *s < 0x20)
+			fprintf(file, "\\u%04x", (unsigned char) *s);
+		else
+			fputc(*s, file);
+	}
+	fputc('"', file);
+}
+
+static void print_json_time(FILE *file, time_t garmin_time)
+{
+	time_t time = garmin_unix_time(garmin_time);
+	struct tm tm_buf;
+	struct tm *tm = gmtime_r(&time, &tm_buf);
+	fprintf(file, "\"%04d-%02d-%02dT%02d:%02d:%02dZ\"", tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday, tm->tm_hour, tm->tm_min, tm->tm_sec);
+}
+
+void garmini_write_summary(FILE *file, const char *filename, const garmini_summary_t *summary)
+{
+	fprintf(file, "{\"filename\":");
+	print_json_string(file, filename);
+	fprintf(file, ",\"start\":");
+	print_json_time(file, summary->first_time);
+	fprintf(file, ",\"end\":");
+	print_json_time(file, summary->last_time);
+	fprintf(file, ",\"duration\":%ld,\"points\":%d", (long) (summary->last_time - summary->first_time), summary->npoints);
+	if (summary->min_alt <= summary->max_alt)
+		fprintf(file, ",\"min_alt\":%.1f,\"max_alt\":%.1f", summary->min_alt, summary->max_alt);
+	fprintf(file, ",\"distance\":%.1f,\"gain\":%.1f,\"max_climb\":%.2f,\"max_sink\":%.2f", summary->distance, summary->gain, summary->max_climb, summary->max_sink);
+	if (summary->min_posn.lat != 0x7fffffff)
+		fprintf(file, ",\"bbox\":[%.6f,%.6f,%.6f,%.6f]", 180.0 * summary->min_posn.lat / 2147483648.0, 180.0 * summary->min_posn.lon / 2147483648.0, 180.0 * summary->max_posn.lat / 2147483648.0, 180.0 * summary->max_posn.lon / 2147483648.0);
+	fprintf(file, "}\n");
+}
+
+void garmini_download(garmini_session_t *session)
+{
+	garmini_track_t *track = garmini_track(session);
+	float *alt = 0;
+	if (smooth == SMOOTH_ANALYSIS) {
+		alt = garmin_arena_alloc(track->arena, (track->end - track->begin) * sizeof(float));
+		garmini_track_smoothed(track, alt);
+	}
+	garmini_track_index_t *index = summary ? garmini_track_index_new(track->begin, track->end, alt) : 0;
+	garmini_output_t *output = garmini_output_new(io_uring, durability, gzip, !quiet, archive);
 	struct tm last_tm;
 	memset(&last_tm, 0, sizeof last_tm);
 	int track_number = 0;
@@ -327,17 +511,18 @@ void garmini_download(garmin_t *garmin)
 		while (trk_point < track->end) {
 			if (trk_point->time - trk_point[-1].time > 60)
 				break;
+			/* Once the flight is accepted only its end is still sought. */
 			if (!accepted) {
-				if (trk_point->validity == 'A') {
-					if (trk_point->alt < min_alt)
-						min_alt = trk_point->alt;
-					if (trk_point->alt > max_alt)
-						max_alt = trk_point->alt;
+				if (trk_point->valid) {
+					float trk_point_alt = alt ? alt[trk_point - track->begin] : trk_point->alt;
+					if (trk_point_alt < min_alt)
+						min_alt = trk_point_alt;
+					if (trk_point_alt > max_alt)
+						max_alt = trk_point_alt;
 					if (max_alt - min_alt > 30.0)
 						accepted = 1;
 				}
-				double distance = garmini_distance_fai(trk_point - 1, trk_point);
-				double speed = distance / (trk_point->time - trk_point[-1].time);
+				double speed = garmini_distance_fai(trk_point - 1, trk_point) / (trk_point->time - trk_point[-1].time);
 				if (speed > 10.0 / 3.6) {
 					if (first) {
 						if (trk_point->time - first[-1].time > 60)
@@ -353,8 +538,9 @@ void garmini_download(garmin_t *garmin)
 		}
 		if (!accepted || trk_point[-1].time - begin->time < 3 * 60)
 			continue;
-		time_t time = begin->time + GARMIN_TIME_OFFSET;
-		struct tm *tm = gmtime(&time);
+		time_t time = garmin_unix_time(begin->time);
+		struct tm tm_buf;
+		struct tm *tm = gmtime_r(&time, &tm_buf);
 		if (tm->tm_year == last_tm.tm_year && tm->tm_mon == last_tm.tm_mon && tm->tm_mday == last_tm.tm_mday)
 			++track_number;
 		else {
@@ -362,43 +548,318 @@ void garmini_download(garmin_t *garmin)
 			last_tm = *tm;
 		}
 		char filename[1024];
-		snprintf(filename, sizeof filename, "%04d-%02d-%02d-%s-%d-%02d.IGC", tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday, manufacturer, serial_number, track_number);
-		FILE *file = fopen(filename, "w");
-		if (!file)
-			error("%s: %s", filename, strerror(errno));
-		garmini_write_igc(file, garmin, begin, trk_point);
-		if (fclose(file))
-			error("%s: %s", filename, strerror(errno));
+		snprintf(filename, sizeof filename, "%04d-%02d-%02d-%s-%d-%02d.IGC", tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday, manufacturer, session->serial_number, track_number);
+		garmini_buffer_t buffer;
+		garmini_buffer_init(&buffer);
+		garmini_write_igc(&buffer, session, begin, trk_point);
+		garmini_output_file(output, filename, buffer.data, buffer.size);
+		if (summary) {
+			char summary_filename[1024];
+			snprintf(summary_filename, sizeof summary_filename, "%04d-%02d-%02d-%s-%d-%02d.json", tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday, manufacturer, session->serial_number, track_number);
+			char *data;
+			size_t size;
+			FILE *file = open_memstream(&data, &size);
+			if (!file)
+				DIE("open_memstream", errno);
+			char igc_filename[sizeof filename + 3];
+			snprintf(igc_filename, sizeof igc_filename, "%s%s", filename, gzip ? ".gz" : "");
+			garmini_summary_t flight_summary;
+			garmini_summary_range(&flight_summary, index, begin - track->begin, trk_point - track->begin);
+			garmini_write_summary(file, igc_filename, &flight_summary);
+			if (fclose(file))
+				DIE("fclose", errno);
+			garmini_output_file(output, summary_filename, data, size);
+		}
+	}
+	garmini_output_delete(output);
+	garmini_track_index_delete(index);
+}
+
+/* prefix starts every line, normally just the program name. */
+static void garmini_print_latency(FILE *file, const char *prefix, const char *name, const garmin_latency_t *latency)
+{
+	if (!latency->count)
+		return;
+	fprintf(file, "%s: %d %s: min %.3fms, mean %.3fms, max %.3fms\n", prefix, latency->count, name, latency->min / 1000.0, (double) latency->total / latency->count / 1000.0, latency->max / 1000.0);
+	int first = 0, last = GARMIN_LATENCY_BUCKETS - 1, peak = 0;
+	while (!latency->buckets[first])
+		++first;
+	while (!latency->buckets[last])
+		--last;
+	int i;
+	for (i = first; i <= last; ++i)
+		if (latency->buckets[i] > peak)
+			peak = latency->buckets[i];
+	for (i = first; i <= last; ++i) {
+		int width = (latency->buckets[i] * 40 + peak - 1) / peak;
+		fprintf(file, "%s: %9.3fms %7d ", prefix, (1 << i) / 1000.0, latency->buckets[i]);
+		while (width--)
+			fputc('#', file);
+		fputc('\n', file);
+	}
+}
+
+/* Link test: time repeated product requests and extrapolate to the track
+ * log.  A track point and its ACK are close in size to the packets of the
+ * product exchange, so the time per packet measured here predicts the
+ * transfer time; at the full line rate each byte takes ten bit times. */
+#define GARMINI_LINKTEST_EXCHANGES 32
+
+static void garmini_linktest(garmini_session_t *session)
+{
+	garmin_t *garmin = session->garmin;
+	garmin_linktest_t linktest;
+	garmin_linktest(garmin, GARMINI_LINKTEST_EXCHANGES, &linktest);
+	flockfile(stdout);
+	garmini_print_latency(stdout, program_name, "product requests", &linktest.exchanges);
+	double elapsed = linktest.elapsed / 1e6;
+	double rate = elapsed > 0 ? linktest.bytes / elapsed : 0;
+	printf("%s: %d packets, %lld bytes in %.3fs, %.0f bytes/s", program_name, linktest.packets, (long long) linktest.bytes, elapsed, rate);
+	int baud = garmin->transport->baud;
+	if (baud)
+		printf(", %.0f%% of %d baud", 100.0 * rate / (baud / 10.0), baud);
+	printf("\n");
+	int expected = linktest.packets ? linktest.records * elapsed / linktest.packets + 0.5 : 0;
+	printf("%s: track log: %d records, about %d:%02d", program_name, linktest.records, expected / 60, expected % 60);
+	if (baud && linktest.packets) {
+		int ideal = linktest.records * ((double) linktest.bytes / linktest.packets) / (baud / 10.0) + 0.5;
+		printf(" (%d:%02d at line rate)", ideal / 60, ideal % 60);
+	}
+	printf("\n");
+	funlockfile(stdout);
+}
+
+/* Several commands may be given in one run; they share the session and the
+ * cached track log, so the device is only asked for it once. */
+typedef void (*garmini_command_t)(garmini_session_t *);
+
+static const struct {
+	const char *name;
+	const char *alias;
+	garmini_command_t run;
+} commands[] = {
+	{ "id", 0, garmini_id },
+	{ "download", "do", garmini_download },
+	{ "igc", "ig", garmini_igc },
+	{ "linktest", 0, garmini_linktest },
+};
+
+static garmini_command_t garmini_command(const char *name)
+{
+	unsigned i;
+	for (i = 0; i < sizeof commands / sizeof commands[0]; ++i)
+		if (strcmp(name, commands[i].name) == 0 || (commands[i].alias && strcmp(name, commands[i].alias) == 0))
+			return commands[i].run;
+	return 0;
+}
+
+static garmin_logger_t *logger = 0;
+static garmini_session_t *sessions = 0;
+static int nsessions = 0;
+static char **command_names = 0;
+static int ncommand_names = 0;
+
+static void garmini_close_log(void)
+{
+	int i;
+	for (i = 0; i < nsessions; ++i) {
+		garmin_log_delete(sessions[i].log);
+		sessions[i].log = 0;
+	}
+	garmin_logger_delete(logger);
+	logger = 0;
+}
+
+/* Runs on exit after an error, so that the logs show what led to it.  Other
+ * sessions may still be running and appending to their logs, so these are
+ * only flushed; they are freed with the process. */
+static void garmini_flush_log(void)
+{
+	if (logger)
+		garmin_logger_flush(logger);
+}
+
+static void garmini_report_faults(void)
+{
+	int i;
+	for (i = 0; i < nsessions; ++i) {
+		if (sessions[i].faults)
+			garmin_faults_report(sessions[i].faults, stderr);
+		sessions[i].faults = 0;
+	}
+}
+
+static void garmini_add_session(const char *device, int replay)
+{
+	garmini_session_t *session = sessions + nsessions++;
+	session->device = device;
+	session->replay = replay;
+}
+
+/* Opens the session's transport and log in the main thread, so that a bad
+ * device name fails before anything is transferred.  With several sessions,
+ * session i logs to FILENAME.i, so that each log can be replayed on its own,
+ * and tags its lines with its index in case they share stdout. */
+static void garmini_session_open(garmini_session_t *session, int i)
+{
+	const char *device = session->device;
+	garmin_transport_t *transport;
+	if (session->replay) {
+		transport = garmin_replay_new(device);
+	} else if (strncmp(device, "tcp:", 4) == 0) {
+		transport = garmin_tcp_new(device + 4, 0);
+	} else if (strncmp(device, "rfc2217:", 8) == 0) {
+		transport = garmin_tcp_new(device + 8, 1);
+	} else if (strncmp(device, "usb:", 4) == 0) {
+		transport = garmin_usb_new(device + 4);
+	} else {
+		transport = garmin_serial_new(device, serial);
+		if (serial && !quiet)
+			garmin_serial_report(transport, stderr);
+	}
+	if (faults) {
+		transport = garmin_faults_new(transport, faults);
 		if (!quiet)
-			fprintf(stderr, "%s: wrote %s\n", program_name, filename);
+			session->faults = transport;
+	}
+	if (logger) {
+		FILE *file = stdout;
+		if (strcmp(logfile, "-") != 0) {
+			char filename[1024];
+			if (concurrent)
+				snprintf(filename, sizeof filename, "%s.%d", logfile, i);
+			else
+				snprintf(filename, sizeof filename, "%s", logfile);
+			file = fopen(filename, "a");
+			if (!file)
+				error("fopen: %s: %s", filename, strerror(errno));
+		}
+		char tag[1024];
+		if (concurrent)
+			snprintf(tag, sizeof tag, "%s#%d", transport->name, i);
+		else
+			snprintf(tag, sizeof tag, "%s", transport->name);
+		session->log = garmin_log_new(logger, file, tag);
 	}
-	garmini_track_delete(track);
+	session->transport = transport;
+	session->serial_number = serial_number + i;
+	size_t size;
+	FILE *file = open_memstream(&session->json_device, &size);
+	if (!file)
+		DIE("open_memstream", errno);
+	print_json_string(file, transport->name);
+	if (fclose(file))
+		DIE("fclose", errno);
+}
+
+static void *garmini_session_run(void *data)
+{
+	garmini_session_t *session = data;
+	session->start = garmin_real_clock.now(&garmin_real_clock);
+	session->garmin = garmin_new_transport(session->transport, session->log);
+	session->transport = 0;
+	session->barometric_altimeter = barometric_altimeter;
+	if (session->barometric_altimeter == -1)
+		session->barometric_altimeter = garmin_has_barometric_altimeter(session->garmin);
+	if (!ncommand_names)
+		garmini_download(session);
+	int i;
+	for (i = 0; i < ncommand_names; ++i)
+		garmini_command(command_names[i])(session);
+	if (power_off)
+		garmin_turn_off_pwr(session->garmin);
+	session->finish = garmin_real_clock.now(&garmin_real_clock);
+	return 0;
+}
+
+static int garmini_compare_int64(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+/* Per session link statistics, then the run as a whole: records per second
+ * over the wall time, how long the sessions took to complete, and the CPU
+ * time and peak memory of the process. */
+static void garmini_print_stats(void)
+{
+	int64_t *durations = alloc(nsessions * sizeof(int64_t));
+	int64_t start = sessions[0].start, finish = sessions[0].finish;
+	long long records = 0;
+	int i;
+	for (i = 0; i < nsessions; ++i) {
+		garmini_session_t *session = sessions + i;
+		char prefix[1024];
+		if (concurrent)
+			snprintf(prefix, sizeof prefix, "%s: %s", program_name, session->garmin->device);
+		else
+			snprintf(prefix, sizeof prefix, "%s", program_name);
+		garmini_print_latency(stderr, prefix, "round trips", &session->garmin->latency);
+		garmini_print_latency(stderr, prefix, "ACK turnarounds", &session->garmin->turnaround);
+		fprintf(stderr, "%s: %d NAKs, %d retransmissions, %d duplicates\n", prefix, session->garmin->naks, session->garmin->retransmissions, session->garmin->duplicates);
+		if (session->track)
+			records += session->track->end - session->track->begin;
+		if (session->start < start)
+			start = session->start;
+		if (session->finish > finish)
+			finish = session->finish;
+		durations[i] = session->finish - session->start;
+	}
+	double elapsed = (finish - start) / 1e6;
+	fprintf(stderr, "%s: %d session%s, %lld records in %.3fs, %.0f records/s\n", program_name, nsessions, nsessions == 1 ? "" : "s", records, elapsed, elapsed > 0 ? records / elapsed : 0);
+	if (concurrent) {
+		qsort(durations, nsessions, sizeof(int64_t), garmini_compare_int64);
+		fprintf(stderr, "%s: sessions completed in min %.3fs, median %.3fs, p90 %.3fs, max %.3fs\n", program_name, durations[0] / 1e6, durations[nsessions / 2] / 1e6, durations[nsessions * 9 / 10] / 1e6, durations[nsessions - 1] / 1e6);
+	}
+	free(durations);
+	struct rusage rusage;
+	if (getrusage(RUSAGE_SELF, &rusage) == -1)
+		DIE("getrusage", errno);
+	fprintf(stderr, "%s: cpu user %.3fs, system %.3fs, max rss %ldkB, %s kernels\n", program_name, rusage.ru_utime.tv_sec + rusage.ru_utime.tv_usec / 1e6, rusage.ru_stime.tv_sec + rusage.ru_stime.tv_usec / 1e6, rusage.ru_maxrss, garmini_cpu_name(garmini_cpu()));
 }
 
 static void usage(void)
 {
 	printf("%s - download track log from Garmin GPSs\n"
-			"Usage: %s [options] [command]\n"
+			"Usage: %s [options] [command...]\n"
 			"Options:\n"
 			"\t-h, --help\t\t\tshow some help\n"
 			"\t-q, --quiet\t\t\tsuppress output\n"
-			"\t-d, --device=DEVICE\t\tselect device (default is %s)\n"
+			"\t-d, --device=DEVICE\t\tselect device (default is %s), or one of\n"
+			"\t\t\t\t\tusb:[PATH], tcp:HOST:PORT, rfc2217:HOST:PORT;\n"
+			"\t\t\t\t\trepeat -d or -r to use several devices at once\n"
 			"\t-D, --directory=DIR\t\tdownload tracklogs to DIR\n"
-			"\t-l, --log=FILENAME\t\tlog communication to FILENAME\n"
+			"\t-A, --archive=FILE\t\tappend tracklogs to the tar archive FILE\n"
+			"\t-l, --log=FILENAME\t\tlog communication to FILENAME, or with\n"
+			"\t\t\t\t\tseveral devices to FILENAME.0, FILENAME.1...\n"
+			"\t-r, --replay=FILENAME\t\treplay a communication log instead of a device\n"
+			"\t-F, --faults=SPEC\t\tinject faults, e.g. seed=1,flip=0.001,drop=0.01\n"
+			"\t-P, --serial=SPEC\t\ttune serial port, e.g. low-latency,vmin=32,vtime=1\n"
+			"\t-X, --stats\t\t\tshow round trip and ACK times, throughput and usage\n"
+			"\t-C, --cpu=KERNELS\t\tforce scalar, sse4.2, avx2 or avx512 kernels\n"
+			"\t-J, --progress-fd=FD\t\twrite progress as JSON lines to FD\n"
 			"\t-o, --power-off\t\t\tpower off GPS\n"
+			"\t-u, --io-uring\t\t\twrite tracklogs in batches using io_uring\n"
+			"\t-y, --durability=MODE\t\tsync tracklogs none, group or strict\n"
+			"\t-z, --gzip\t\t\tcompress output with gzip\n"
+			"\t-S, --summary\t\t\twrite a JSON summary next to each tracklog\n"
+			"\t-k, --smooth=MODE\t\tsmooth altitudes for none, analysis or output\n"
 			"IGC options:\n"
 			"\t-m, --manufacturer=STRING\toverride manufacturer\n"
-			"\t-s, --serial-number=NUMBER\toverride serial number\n"
+			"\t-s, --serial-number=NUMBER\toverride serial number, counting up per device\n"
 			"\t-p, --pilot=PILOT\t\tset pilot\n"
 			"\t-t, --glider-type=TYPE\t\tset glider type\n"
 			"\t-g, --glider-id=ID\t\tset glider id\n"
 			"\t-c, --competition-class=CLASS\tset competition class\n"
 			"\t-i, --competition-id=ID\t\tset competition id\n"
 			"\t-b, --barometric-altimeter=0|1\tset barometric altimeter\n"
+			"\t-G, --g-record[=KEY]\t\tappend a SHA-256 (or HMAC-SHA256) G record\n"
 			"Commands:\n"
 			"\tid\t\tidentify GPS\n"
 			"\tdo, download\tdownload tracklogs\n"
-			"\tig, igc\t\twrite entire track log to stdout\n",
+			"\tig, igc\t\twrite entire track log to stdout\n"
+			"\tlinktest\tmeasure the link and estimate the download time\n"
+			"Several commands may be given; the track log is transferred once.\n",
 		program_name, program_name, DEVICE);
 }
 
@@ -414,6 +875,8 @@ int main(int argc, char *argv[])
 	setenv("TZ", "UTC", 1);
 	tzset();
 
+	sessions = alloc(argc * sizeof(garmini_session_t));
+
 	opterr = 0;
 	while (1) {
 		static struct option options[] = {
@@ -421,8 +884,20 @@ int main(int argc, char *argv[])
 			{ "quiet",                no_argument,       0, 'q' },
 			{ "device",               required_argument, 0, 'd' },
 			{ "directory",            required_argument, 0, 'D' },
+			{ "archive",              required_argument, 0, 'A' },
 			{ "log",                  required_argument, 0, 'l' },
+			{ "replay",               required_argument, 0, 'r' },
+			{ "faults",               required_argument, 0, 'F' },
+			{ "serial",               required_argument, 0, 'P' },
+			{ "stats",                no_argument,       0, 'X' },
+			{ "cpu",                  required_argument, 0, 'C' },
+			{ "progress-fd",          required_argument, 0, 'J' },
 			{ "power-off",            no_argument,       0, 'o' },
+			{ "io-uring",             no_argument,       0, 'u' },
+			{ "durability",           required_argument, 0, 'y' },
+			{ "gzip",                 no_argument,       0, 'z' },
+			{ "summary",              no_argument,       0, 'S' },
+			{ "smooth",               required_argument, 0, 'k' },
 			{ "manufacturer",         required_argument, 0, 'm' },
 			{ "serial-number",        required_argument, 0, 's' },
 			{ "pilot",                required_argument, 0, 'p' },
@@ -431,16 +906,28 @@ int main(int argc, char *argv[])
 			{ "competition-class",    required_argument, 0, 'c' },
 			{ "competition-id",       required_argument, 0, 'i' },
 			{ "barometric-altimeter", required_argument, 0, 'b' },
+			{ "g-record",             optional_argument, 0, 'G' },
 			{ 0,                      0,                 0, 0 },
 		};
-		int c = getopt_long(argc, argv, ":hqd:D:l:om:s:p:t:g:c:i:b:", options, 0);
+		int c = getopt_long(argc, argv, ":hqd:D:A:l:r:F:P:XC:J:ouy:zSk:m:s:p:t:g:c:i:b:G::", options, 0);
 		if (c == -1)
 			break;
 		char *endptr;
 		switch (c) {
+			case 'A':
+				archive_filename = optarg;
+				break;
 			case 'D':
 				directory = optarg;
 				break;
+			case 'G':
+				g_record = 1;
+				if (optarg)
+					g_record_key = optarg;
+				break;
+			case 'S':
+				summary = 1;
+				break;
 			case 'b':
 				barometric_altimeter = strtol(optarg, &endptr, 10);
 				if (endptr == optarg || *endptr != '\0' || barometric_altimeter < 0 || 1 < barometric_altimeter)
@@ -450,7 +937,7 @@ int main(int argc, char *argv[])
 				competition_class = optarg;
 				break;
 			case 'd':
-				device = optarg;
+				garmini_add_session(optarg, 0);
 				break;
 			case 'g':
 				glider_id = optarg;
@@ -461,14 +948,40 @@ int main(int argc, char *argv[])
 			case 'i':
 				competition_id = optarg;
 				break;
+			case 'k':
+				if (strcmp(optarg, "none") == 0)
+					smooth = SMOOTH_NONE;
+				else if (strcmp(optarg, "analysis") == 0)
+					smooth = SMOOTH_ANALYSIS;
+				else if (strcmp(optarg, "output") == 0)
+					smooth = SMOOTH_OUTPUT;
+				else
+					error("invalid argument '%s'", optarg);
+				break;
 			case 'l':
-				if (strcmp(optarg, "-") == 0)
-					logfile = stdout;
-				else {
-					logfile = fopen(optarg, "a");
-					if (!logfile)
-						error("fopen: %s: %s", optarg, strerror(errno));
-				}
+				logfile = optarg;
+				break;
+			case 'r':
+				garmini_add_session(optarg, 1);
+				break;
+			case 'F':
+				faults = optarg;
+				break;
+			case 'P':
+				serial = optarg;
+				break;
+			case 'X':
+				stats = 1;
+				break;
+			case 'C':
+				if (garmini_cpu_parse(optarg) == -1)
+					error("invalid argument '%s'", optarg);
+				garmini_cpu_force(garmini_cpu_parse(optarg));
+				break;
+			case 'J':
+				progress_fd = strtol(optarg, &endptr, 10);
+				if (endptr == optarg || *endptr != '\0' || progress_fd < 0)
+					error("invalid file descriptor '%s'", optarg);
 				break;
 			case 'm':
 				manufacturer = optarg;
@@ -481,6 +994,22 @@ int main(int argc, char *argv[])
 			case 'o':
 				power_off = 1;
 				break;
+			case 'u':
+				io_uring = 1;
+				break;
+			case 'y':
+				if (strcmp(optarg, "none") == 0)
+					durability = GARMINI_DURABILITY_NONE;
+				else if (strcmp(optarg, "group") == 0)
+					durability = GARMINI_DURABILITY_GROUP;
+				else if (strcmp(optarg, "strict") == 0)
+					durability = GARMINI_DURABILITY_STRICT;
+				else
+					error("invalid argument '%s'", optarg);
+				break;
+			case 'z':
+				gzip = 1;
+				break;
 			case 'p':
 				pilot = optarg;
 				break;
@@ -497,31 +1026,54 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	garmin_t *garmin = garmin_new(device, logfile);
+	int i;
+	for (i = optind; i < argc; ++i)
+		if (!garmini_command(argv[i]))
+			error("invalid command '%s'", argv[i]);
+	command_names = argv + optind;
+	ncommand_names = argc - optind;
 
-	if (barometric_altimeter == -1)
-		barometric_altimeter = garmin_has_barometric_altimeter(garmin);
+	if (!nsessions)
+		garmini_add_session(device, 0);
+	concurrent = nsessions > 1;
+	if (logfile) {
+		logger = garmin_logger_new();
+		atexit(garmini_flush_log);
+	}
+	if (faults && !quiet)
+		atexit(garmini_report_faults);
+	for (i = 0; i < nsessions; ++i)
+		garmini_session_open(sessions + i, i);
+	if (archive_filename)
+		archive = garmini_archive_new(archive_filename, durability, !quiet);
+	if (directory && chdir(directory) == -1)
+		error("chdir: %s: %s", directory, strerror(errno));
 
-	if (optind == argc || strcmp(argv[optind], "do") == 0 || strcmp(argv[optind], "download") == 0) {
-		garmini_download(garmin);
-	} else {
-		if (optind + 1 != argc)
-			error("excess arguments on command line");
-		if (strcmp(argv[optind], "id") == 0) {
-			garmini_id(garmin);
-		} else if (strcmp(argv[optind], "ig") == 0 || strcmp(argv[optind], "igc") == 0) {
-			garmini_igc(garmin);
-		} else {
-			error("invalid command '%s'", argv[optind]);
+	if (concurrent) {
+		for (i = 0; i < nsessions; ++i) {
+			int rc = pthread_create(&sessions[i].thread, 0, garmini_session_run, sessions + i);
+			if (rc)
+				DIE("pthread_create", rc);
+		}
+		for (i = 0; i < nsessions; ++i) {
+			int rc = pthread_join(sessions[i].thread, 0);
+			if (rc)
+				DIE("pthread_join", rc);
 		}
+	} else {
+		garmini_session_run(sessions);
 	}
+	if (archive)
+		garmini_archive_delete(archive);
 
-	if (power_off)
-		garmin_turn_off_pwr(garmin);
-
-	garmin_delete(garmin);
-	if (logfile && logfile != stdout)
-		fclose(logfile);
+	if (stats)
+		garmini_print_stats();
+	garmini_report_faults();
+	for (i = 0; i < nsessions; ++i) {
+		garmin_delete(sessions[i].garmin);
+		free(sessions[i].json_device);
+	}
+	garmini_close_log();
 
 	return 0;
 }
@@ -31,6 +31,7 @@ void error(const char *, ...);
 void warning(const char *, ...);
 void die(const char *, int, const char *, const char *, int);
 void *alloc(int);
+int format_char(char *, int);
 void print_string(FILE *, const char *, ...);
 
 #endif
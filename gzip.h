@@ -0,0 +1,35 @@
+/*
+
+   garmini - download track log from Garmin GPSs
+   Copyright (C) 2007  Tom Payne
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef GZIP_H
+#define GZIP_H
+
+#include <stddef.h>
+
+#include "output.h"
+
+typedef struct gzip gzip_t;
+
+gzip_t *gzip_new(garmini_buffer_t *);
+void gzip_update(gzip_t *, const void *, size_t);
+void gzip_final(gzip_t *);
+void gzip_buffer(garmini_buffer_t *, const void *, size_t);
+
+#endif
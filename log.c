@@ -0,0 +1,237 @@
+/*
+
+   garmini - download track log from Garmin GPSs
+   Copyright (C) 2007  Tom Payne
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "garmini.h"
+#include "log.h"
+
+/* Each session logs into its own ring, which a single background thread
+ * drains into the session's file.  Appending to a ring takes no lock and
+ * never waits: the session only ever advances head and the drain thread only
+ * tail, so when the ring is full the entry is dropped and counted rather
+ * than holding up the link.  Every entry is one line starting with a UTC
+ * timestamp and the session's tag, which replays skip over. */
+
+#define GARMIN_LOG_SIZE (1 << 20)
+#define GARMIN_LOG_LINE 2048
+#define GARMIN_LOG_INTERVAL (50 * 1000 * 1000)
+
+struct garmin_log {
+	garmin_log_t *next;
+	FILE *file;
+	char *tag;
+	uint64_t head;
+	uint64_t tail;
+	unsigned dropped;
+	unsigned reported;
+	int closed;
+	char ring[GARMIN_LOG_SIZE];
+};
+
+struct garmin_logger {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t thread;
+	garmin_log_t *logs;
+	int stopping;
+};
+
+static void garmin_log_fwrite(garmin_log_t *log, const char *data, size_t size)
+{
+	if (size && fwrite(data, 1, size, log->file) != size)
+		warning("%s: cannot write log: %s", log->tag, strerror(errno));
+}
+
+/* Writes out everything appended so far, returning whether the log was
+ * closed and is now empty. */
+static int garmin_log_drain(garmin_log_t *log)
+{
+	int closed = __atomic_load_n(&log->closed, __ATOMIC_ACQUIRE);
+	uint64_t head = __atomic_load_n(&log->head, __ATOMIC_ACQUIRE);
+	uint64_t tail = log->tail;
+	if (head != tail) {
+		size_t begin = tail % GARMIN_LOG_SIZE, end = head % GARMIN_LOG_SIZE;
+		if (begin < end) {
+			garmin_log_fwrite(log, log->ring + begin, end - begin);
+		} else {
+			garmin_log_fwrite(log, log->ring + begin, GARMIN_LOG_SIZE - begin);
+			garmin_log_fwrite(log, log->ring, end);
+		}
+		__atomic_store_n(&log->tail, head, __ATOMIC_RELEASE);
+	}
+	unsigned dropped = __atomic_load_n(&log->dropped, __ATOMIC_RELAXED);
+	if (dropped != log->reported) {
+		fprintf(log->file, "%s: %u log entries dropped\n", log->tag, dropped - log->reported);
+		log->reported = dropped;
+	}
+	if (head != tail || closed)
+		fflush(log->file);
+	return closed;
+}
+
+static void garmin_log_free(garmin_log_t *log)
+{
+	if (log->file != stdout && fclose(log->file))
+		warning("%s: cannot close log: %s", log->tag, strerror(errno));
+	free(log->tag);
+	free(log);
+}
+
+static void *garmin_logger_thread(void *data)
+{
+	garmin_logger_t *logger = data;
+	pthread_mutex_lock(&logger->mutex);
+	while (1) {
+		garmin_log_t **p = &logger->logs;
+		while (*p) {
+			garmin_log_t *log = *p;
+			if (garmin_log_drain(log)) {
+				*p = log->next;
+				garmin_log_free(log);
+			} else {
+				p = &log->next;
+			}
+		}
+		if (logger->stopping && !logger->logs)
+			break;
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += GARMIN_LOG_INTERVAL;
+		if (deadline.tv_nsec >= 1000000000) {
+			++deadline.tv_sec;
+			deadline.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&logger->cond, &logger->mutex, &deadline);
+	}
+	pthread_mutex_unlock(&logger->mutex);
+	return 0;
+}
+
+garmin_logger_t *garmin_logger_new(void)
+{
+	garmin_logger_t *logger = alloc(sizeof(garmin_logger_t));
+	pthread_mutex_init(&logger->mutex, 0);
+	pthread_cond_init(&logger->cond, 0);
+	logger->logs = 0;
+	logger->stopping = 0;
+	int rc = pthread_create(&logger->thread, 0, garmin_logger_thread, logger);
+	if (rc)
+		DIE("pthread_create", rc);
+	return logger;
+}
+
+/* Waits for every log to be closed and written out. */
+void garmin_logger_delete(garmin_logger_t *logger)
+{
+	if (!logger)
+		return;
+	pthread_mutex_lock(&logger->mutex);
+	logger->stopping = 1;
+	pthread_cond_signal(&logger->cond);
+	pthread_mutex_unlock(&logger->mutex);
+	int rc = pthread_join(logger->thread, 0);
+	if (rc)
+		DIE("pthread_join", rc);
+	pthread_cond_destroy(&logger->cond);
+	pthread_mutex_destroy(&logger->mutex);
+	free(logger);
+}
+
+/* Writes out what every log holds so far, without closing or freeing any.
+ * This is for exiting after an error, when other sessions may still be
+ * appending to their logs. */
+void garmin_logger_flush(garmin_logger_t *logger)
+{
+	pthread_mutex_lock(&logger->mutex);
+	garmin_log_t *log;
+	for (log = logger->logs; log; log = log->next)
+		garmin_log_drain(log);
+	pthread_mutex_unlock(&logger->mutex);
+}
+
+/* Takes ownership of file, which is closed once the log has been written
+ * out, unless it is stdout. */
+garmin_log_t *garmin_log_new(garmin_logger_t *logger, FILE *file, const char *tag)
+{
+	garmin_log_t *log = alloc(sizeof(garmin_log_t));
+	log->file = file;
+	log->tag = strdup(tag);
+	if (!log->tag)
+		DIE("strdup", errno);
+	log->head = log->tail = 0;
+	log->dropped = log->reported = 0;
+	log->closed = 0;
+	pthread_mutex_lock(&logger->mutex);
+	log->next = logger->logs;
+	logger->logs = log;
+	pthread_mutex_unlock(&logger->mutex);
+	return log;
+}
+
+/* Appends size bytes, which should be whole lines, or drops them if they do
+ * not fit. */
+void garmin_log_write(garmin_log_t *log, const char *data, int size)
+{
+	uint64_t head = log->head;
+	uint64_t tail = __atomic_load_n(&log->tail, __ATOMIC_ACQUIRE);
+	if (GARMIN_LOG_SIZE - (head - tail) < (uint64_t) size) {
+		__atomic_add_fetch(&log->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	size_t begin = head % GARMIN_LOG_SIZE;
+	size_t n = GARMIN_LOG_SIZE - begin < (size_t) size ? GARMIN_LOG_SIZE - begin : (size_t) size;
+	memcpy(log->ring + begin, data, n);
+	memcpy(log->ring, data + n, size - n);
+	__atomic_store_n(&log->head, head + size, __ATOMIC_RELEASE);
+}
+
+/* Appends one line, prefixed with the time and the log's tag. */
+void garmin_log_printf(garmin_log_t *log, const char *format, ...)
+{
+	char line[GARMIN_LOG_LINE];
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	struct tm tm;
+	gmtime_r(&ts.tv_sec, &tm);
+	int n = strftime(line, sizeof line, "%Y-%m-%dT%H:%M:%S", &tm);
+	n += snprintf(line + n, sizeof line - n, ".%06ldZ %s ", ts.tv_nsec / 1000, log->tag);
+	va_list ap;
+	va_start(ap, format);
+	int m = vsnprintf(line + n, sizeof line - n - 1, format, ap);
+	va_end(ap);
+	n = m < (int) sizeof line - n - 1 ? n + m : (int) sizeof line - 2;
+	line[n++] = '\n';
+	garmin_log_write(log, line, n);
+}
+
+/* Closes the log; whatever is still in its ring is written out, and the log
+ * freed, in the background. */
+void garmin_log_delete(garmin_log_t *log)
+{
+	if (log)
+		__atomic_store_n(&log->closed, 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,37 @@
+/*
+
+   garmini - download track log from Garmin GPSs
+   Copyright (C) 2007  Tom Payne
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdio.h>
+
+typedef struct garmin_logger garmin_logger_t;
+typedef struct garmin_log garmin_log_t;
+
+garmin_logger_t *garmin_logger_new(void);
+void garmin_logger_delete(garmin_logger_t *);
+void garmin_logger_flush(garmin_logger_t *);
+garmin_log_t *garmin_log_new(garmin_logger_t *, FILE *, const char *);
+void garmin_log_write(garmin_log_t *, const char *, int);
+void garmin_log_printf(garmin_log_t *, const char *, ...) __attribute__ ((format (printf, 2, 3)));
+void garmin_log_delete(garmin_log_t *);
+
+#endif
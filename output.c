@@ -0,0 +1,505 @@
+/*
+
+   garmini - download track log from Garmin GPSs
+   Copyright (C) 2007  Tom Payne
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#endif
+
+#include "archive.h"
+#include "garmini.h"
+#include "gzip.h"
+#include "output.h"
+
+void garmini_buffer_init(garmini_buffer_t *buffer)
+{
+	buffer->data = 0;
+	buffer->size = 0;
+	buffer->capacity = 0;
+}
+
+void garmini_buffer_reserve(garmini_buffer_t *buffer, size_t capacity)
+{
+	if (capacity <= buffer->capacity)
+		return;
+	buffer->data = realloc(buffer->data, capacity);
+	if (!buffer->data)
+		DIE("realloc", errno);
+	buffer->capacity = capacity;
+}
+
+/* Formats directly into the buffer, growing it only if the initial
+ * reservation turns out to be too small. */
+void garmini_buffer_vprintf(garmini_buffer_t *buffer, const char *format, va_list ap)
+{
+	va_list aq;
+	va_copy(aq, ap);
+	size_t available = buffer->capacity - buffer->size;
+	int n = vsnprintf(buffer->data + buffer->size, available, format, aq);
+	va_end(aq);
+	if (n < 0)
+		DIE("vsnprintf", errno);
+	if ((size_t) n >= available) {
+		garmini_buffer_reserve(buffer, 2 * buffer->capacity > buffer->size + n + 1 ? 2 * buffer->capacity : buffer->size + n + 1);
+		vsnprintf(buffer->data + buffer->size, buffer->capacity - buffer->size, format, ap);
+	}
+	buffer->size += n;
+}
+
+void garmini_buffer_printf(garmini_buffer_t *buffer, const char *format, ...)
+{
+	va_list ap;
+	va_start(ap, format);
+	garmini_buffer_vprintf(buffer, format, ap);
+	va_end(ap);
+}
+
+/* Files are written either immediately or, when io_uring is available and
+ * requested, in batches: one submission opens every file in the batch and a
+ * second preallocates, writes and closes them, so the number of system calls
+ * no longer grows with the number of files.  Either way each file is
+ * preallocated to its final size and written with a single write.
+ *
+ * Every file is written to a temporary name and renamed into place, so a
+ * tracklog is either complete or absent.  How much is synced before the rename
+ * depends on the durability mode: nothing, everything once at the end of the
+ * session (one syncfs for all the files, then the renames and one directory
+ * fsync), or each file and the directory as it is written.
+ *
+ * With an archive, files are instead handed to the archive's writer in
+ * batches, and the archive takes care of durability. */
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+
+#define GARMINI_URING_ENTRIES (8 * GARMINI_OUTPUT_BATCH)
+#define GARMINI_URING_FSYNC ((uint64_t) 1 << 32)
+#define GARMINI_URING_CLOSE ((uint64_t) 1 << 33)
+#define GARMINI_URING_FALLOCATE ((uint64_t) 1 << 34)
+#define GARMINI_URING_OP_MASK (GARMINI_URING_FSYNC | GARMINI_URING_CLOSE | GARMINI_URING_FALLOCATE)
+
+struct garmini_uring {
+	int fd;
+	int fallocate;
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+	int fds[GARMINI_OUTPUT_BATCH];
+};
+
+static int garmini_uring_supported(const struct io_uring_probe *probe, int op)
+{
+	return op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+}
+
+static int garmini_uring_probe(garmini_uring_t *uring)
+{
+	static const int ops[] = { IORING_OP_OPENAT, IORING_OP_WRITE, IORING_OP_FSYNC, IORING_OP_CLOSE };
+	size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = alloc(size);
+	int supported = syscall(__NR_io_uring_register, uring->fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+	unsigned i;
+	for (i = 0; supported && i < sizeof ops / sizeof ops[0]; ++i)
+		if (!garmini_uring_supported(probe, ops[i]))
+			supported = 0;
+	uring->fallocate = supported && garmini_uring_supported(probe, IORING_OP_FALLOCATE);
+	free(probe);
+	return supported;
+}
+
+static void garmini_uring_delete(garmini_uring_t *uring)
+{
+	if (uring) {
+		if (uring->sqes)
+			munmap(uring->sqes, uring->sqes_size);
+		if (uring->cq_ring && uring->cq_ring != uring->sq_ring)
+			munmap(uring->cq_ring, uring->cq_ring_size);
+		if (uring->sq_ring)
+			munmap(uring->sq_ring, uring->sq_ring_size);
+		close(uring->fd);
+		free(uring);
+	}
+}
+
+static garmini_uring_t *garmini_uring_new(void)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof params);
+	int fd = syscall(__NR_io_uring_setup, GARMINI_URING_ENTRIES, &params);
+	if (fd == -1)
+		return 0;
+	garmini_uring_t *uring = alloc(sizeof(garmini_uring_t));
+	uring->fd = fd;
+	if (!garmini_uring_probe(uring))
+		goto _error;
+	uring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	uring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (uring->cq_ring_size > uring->sq_ring_size)
+			uring->sq_ring_size = uring->cq_ring_size;
+		uring->cq_ring_size = uring->sq_ring_size;
+	}
+	uring->sq_ring = mmap(0, uring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (uring->sq_ring == MAP_FAILED) {
+		uring->sq_ring = 0;
+		goto _error;
+	}
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		uring->cq_ring = uring->sq_ring;
+	} else {
+		uring->cq_ring = mmap(0, uring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (uring->cq_ring == MAP_FAILED) {
+			uring->cq_ring = 0;
+			goto _error;
+		}
+	}
+	uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	uring->sqes = mmap(0, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (uring->sqes == MAP_FAILED) {
+		uring->sqes = 0;
+		goto _error;
+	}
+	uring->sq_tail = (unsigned *) ((char *) uring->sq_ring + params.sq_off.tail);
+	uring->sq_mask = (unsigned *) ((char *) uring->sq_ring + params.sq_off.ring_mask);
+	uring->sq_array = (unsigned *) ((char *) uring->sq_ring + params.sq_off.array);
+	uring->cq_head = (unsigned *) ((char *) uring->cq_ring + params.cq_off.head);
+	uring->cq_tail = (unsigned *) ((char *) uring->cq_ring + params.cq_off.tail);
+	uring->cq_mask = (unsigned *) ((char *) uring->cq_ring + params.cq_off.ring_mask);
+	uring->cqes = (struct io_uring_cqe *) ((char *) uring->cq_ring + params.cq_off.cqes);
+	return uring;
+_error:
+	garmini_uring_delete(uring);
+	return 0;
+}
+
+static struct io_uring_sqe *garmini_uring_get_sqe(garmini_uring_t *uring)
+{
+	unsigned tail = *uring->sq_tail;
+	unsigned index = tail & *uring->sq_mask;
+	struct io_uring_sqe *sqe = uring->sqes + index;
+	memset(sqe, 0, sizeof *sqe);
+	uring->sq_array[index] = index;
+	__atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	return sqe;
+}
+
+static void garmini_uring_submit(garmini_uring_t *uring, int n)
+{
+	while (n) {
+		int rc = syscall(__NR_io_uring_enter, uring->fd, n, 0, 0, 0, 0);
+		if (rc == -1) {
+			if (errno == EINTR)
+				continue;
+			DIE("io_uring_enter", errno);
+		}
+		n -= rc;
+	}
+}
+
+static void garmini_uring_reap(garmini_uring_t *uring, struct io_uring_cqe *cqe)
+{
+	unsigned head = *uring->cq_head;
+	while (head == __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE))
+		if (syscall(__NR_io_uring_enter, uring->fd, 0, 1, IORING_ENTER_GETEVENTS, 0, 0) == -1 && errno != EINTR)
+			DIE("io_uring_enter", errno);
+	*cqe = uring->cqes[head & *uring->cq_mask];
+	__atomic_store_n(uring->cq_head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void garmini_uring_write(garmini_uring_t *uring, garmini_output_file_t *files, int nfiles, int datasync)
+{
+	int nsqes = 0;
+	struct io_uring_cqe cqe;
+	int i;
+	for (i = 0; i < nfiles; ++i) {
+		struct io_uring_sqe *sqe = garmini_uring_get_sqe(uring);
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (uintptr_t) files[i].tmpname;
+		sqe->len = 0666;
+		sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+		sqe->user_data = i;
+	}
+	garmini_uring_submit(uring, nfiles);
+	for (i = 0; i < nfiles; ++i) {
+		garmini_uring_reap(uring, &cqe);
+		if (cqe.res < 0)
+			error("%s: %s", files[cqe.user_data].filename, strerror(-cqe.res));
+		else
+			uring->fds[cqe.user_data] = cqe.res;
+	}
+	for (i = 0; i < nfiles; ++i) {
+		struct io_uring_sqe *sqe;
+		if (uring->fallocate && files[i].size) {
+			sqe = garmini_uring_get_sqe(uring);
+			sqe->opcode = IORING_OP_FALLOCATE;
+			sqe->flags = IOSQE_IO_HARDLINK;
+			sqe->fd = uring->fds[i];
+			sqe->off = 0;
+			sqe->addr = files[i].size;
+			sqe->len = 0;
+			sqe->user_data = GARMINI_URING_FALLOCATE | i;
+			++nsqes;
+		}
+		sqe = garmini_uring_get_sqe(uring);
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->flags = IOSQE_IO_LINK;
+		sqe->fd = uring->fds[i];
+		sqe->addr = (uintptr_t) files[i].data;
+		sqe->len = files[i].size;
+		sqe->off = 0;
+		sqe->user_data = i;
+		if (datasync) {
+			sqe = garmini_uring_get_sqe(uring);
+			sqe->opcode = IORING_OP_FSYNC;
+			sqe->flags = IOSQE_IO_LINK;
+			sqe->fd = uring->fds[i];
+			sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+			sqe->user_data = GARMINI_URING_FSYNC | i;
+			++nsqes;
+		}
+		sqe = garmini_uring_get_sqe(uring);
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->fd = uring->fds[i];
+		sqe->user_data = GARMINI_URING_CLOSE | i;
+		nsqes += 2;
+	}
+	garmini_uring_submit(uring, nsqes);
+	for (i = 0; i < nsqes; ++i) {
+		garmini_uring_reap(uring, &cqe);
+		garmini_output_file_t *file = files + (cqe.user_data & ~GARMINI_URING_OP_MASK);
+		if ((cqe.user_data & GARMINI_URING_FALLOCATE) && (cqe.res == -EOPNOTSUPP || cqe.res == -EINVAL))
+			continue;
+		if (cqe.res < 0)
+			error("%s: %s", file->filename, strerror(-cqe.res));
+		else if (!(cqe.user_data & GARMINI_URING_OP_MASK) && (size_t) cqe.res != file->size)
+			error("%s: short write", file->filename);
+	}
+}
+
+#else
+
+struct garmini_uring {
+	int fd;
+};
+
+static garmini_uring_t *garmini_uring_new(void)
+{
+	return 0;
+}
+
+static void garmini_uring_delete(garmini_uring_t *uring)
+{
+}
+
+static void garmini_uring_write(garmini_uring_t *uring, garmini_output_file_t *files, int nfiles, int datasync)
+{
+	abort();
+}
+
+#endif
+
+static void garmini_output_write(const garmini_output_file_t *file, int datasync)
+{
+	int fd = open(file->tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd == -1)
+		error("%s: %s", file->filename, strerror(errno));
+#ifdef __linux__
+	if (file->size && fallocate(fd, 0, 0, file->size) == -1 && errno != EOPNOTSUPP && errno != ENOSYS)
+		error("%s: %s", file->filename, strerror(errno));
+#endif
+	const char *p = file->data;
+	size_t n = file->size;
+	while (n) {
+		ssize_t rc = write(fd, p, n);
+		if (rc == -1) {
+			if (errno == EINTR)
+				continue;
+			error("%s: %s", file->filename, strerror(errno));
+		}
+		p += rc;
+		n -= rc;
+	}
+	if (datasync && fdatasync(fd) == -1)
+		error("%s: %s", file->filename, strerror(errno));
+	if (close(fd) == -1)
+		error("%s: %s", file->filename, strerror(errno));
+}
+
+static void garmini_output_rename(garmini_output_t *output, garmini_output_file_t *file)
+{
+	if (rename(file->tmpname, file->filename) == -1)
+		error("%s: %s", file->filename, strerror(errno));
+	if (output->verbose)
+		fprintf(stderr, "%s: wrote %s\n", program_name, file->filename);
+	free(file->filename);
+	free(file->tmpname);
+}
+
+static void garmini_output_sync_directory(void)
+{
+	int fd = open(".", O_RDONLY | O_DIRECTORY);
+	if (fd == -1)
+		DIE("open", errno);
+	if (fsync(fd) == -1)
+		DIE("fsync", errno);
+	if (close(fd) == -1)
+		DIE("close", errno);
+}
+
+static void garmini_output_sync_filesystem(void)
+{
+#ifdef __linux__
+	int fd = open(".", O_RDONLY | O_DIRECTORY);
+	if (fd == -1)
+		DIE("open", errno);
+	if (syncfs(fd) == -1)
+		DIE("syncfs", errno);
+	if (close(fd) == -1)
+		DIE("close", errno);
+#else
+	sync();
+#endif
+}
+
+garmini_output_t *garmini_output_new(int io_uring, int durability, int gzip, int verbose, garmini_archive_t *archive)
+{
+	garmini_output_t *output = alloc(sizeof(garmini_output_t));
+	output->durability = durability;
+	output->gzip = gzip;
+	output->verbose = verbose;
+	output->archive = archive;
+	if (io_uring && !archive) {
+		output->uring = garmini_uring_new();
+		if (!output->uring && verbose)
+			warning("io_uring not available, falling back to stdio");
+	}
+	return output;
+}
+
+/* Takes ownership of data, which must have been allocated with malloc.  With
+ * gzip the file is compressed and .gz appended to its name. */
+void garmini_output_file(garmini_output_t *output, const char *filename, char *data, size_t size)
+{
+	garmini_output_file_t *file = output->files + output->nfiles++;
+	if (output->gzip) {
+		garmini_buffer_t buffer;
+		garmini_buffer_init(&buffer);
+		gzip_buffer(&buffer, data, size);
+		free(data);
+		data = buffer.data;
+		size = buffer.size;
+	}
+	file->filename = alloc(strlen(filename) + 4);
+	sprintf(file->filename, "%s%s", filename, output->gzip ? ".gz" : "");
+	file->data = data;
+	file->size = size;
+	if (output->archive) {
+		file->tmpname = 0;
+		if (output->nfiles == GARMINI_OUTPUT_BATCH)
+			garmini_output_flush(output);
+		return;
+	}
+	file->tmpname = alloc(strlen(file->filename) + 5);
+	sprintf(file->tmpname, "%s.tmp", file->filename);
+	if (!output->uring || output->nfiles == GARMINI_OUTPUT_BATCH)
+		garmini_output_flush(output);
+}
+
+void garmini_output_flush(garmini_output_t *output)
+{
+	if (!output->nfiles)
+		return;
+	if (output->archive) {
+		garmini_archive_push(output->archive, output->files, output->nfiles);
+		output->nfiles = 0;
+		return;
+	}
+	int datasync = output->durability == GARMINI_DURABILITY_STRICT;
+	int i;
+	if (output->uring)
+		garmini_uring_write(output->uring, output->files, output->nfiles, datasync);
+	else
+		for (i = 0; i < output->nfiles; ++i)
+			garmini_output_write(output->files + i, datasync);
+	for (i = 0; i < output->nfiles; ++i) {
+		free(output->files[i].data);
+		if (output->durability == GARMINI_DURABILITY_GROUP) {
+			if (output->npending == output->pending_capacity) {
+				output->pending_capacity = output->pending_capacity ? 2 * output->pending_capacity : GARMINI_OUTPUT_BATCH;
+				output->pending = realloc(output->pending, output->pending_capacity * sizeof(garmini_output_file_t));
+				if (!output->pending)
+					DIE("realloc", errno);
+			}
+			output->pending[output->npending++] = output->files[i];
+		} else {
+			garmini_output_rename(output, output->files + i);
+		}
+	}
+	if (output->durability == GARMINI_DURABILITY_STRICT)
+		garmini_output_sync_directory();
+	output->nfiles = 0;
+}
+
+/* Makes every file written so far durable and visible under its final name. */
+void garmini_output_commit(garmini_output_t *output)
+{
+	garmini_output_flush(output);
+	if (!output->npending)
+		return;
+	garmini_output_sync_filesystem();
+	int i;
+	for (i = 0; i < output->npending; ++i)
+		garmini_output_rename(output, output->pending + i);
+	garmini_output_sync_directory();
+	output->npending = 0;
+}
+
+void garmini_output_delete(garmini_output_t *output)
+{
+	if (output) {
+		garmini_output_commit(output);
+		garmini_uring_delete(output->uring);
+		free(output->pending);
+		free(output);
+	}
+}
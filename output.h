@@ -0,0 +1,74 @@
+/*
+
+   garmini - download track log from Garmin GPSs
+   Copyright (C) 2007  Tom Payne
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdarg.h>
+#include <stddef.h>
+
+#define GARMINI_OUTPUT_BATCH 64
+
+enum {
+	GARMINI_DURABILITY_NONE,
+	GARMINI_DURABILITY_GROUP,
+	GARMINI_DURABILITY_STRICT
+};
+
+typedef struct {
+	char *filename;
+	char *tmpname;
+	char *data;
+	size_t size;
+} garmini_output_file_t;
+
+typedef struct {
+	char *data;
+	size_t size;
+	size_t capacity;
+} garmini_buffer_t;
+
+typedef struct garmini_uring garmini_uring_t;
+typedef struct garmini_archive garmini_archive_t;
+
+typedef struct {
+	int durability;
+	int gzip;
+	int verbose;
+	garmini_uring_t *uring;
+	garmini_archive_t *archive;
+	int nfiles;
+	garmini_output_file_t files[GARMINI_OUTPUT_BATCH];
+	int npending;
+	int pending_capacity;
+	garmini_output_file_t *pending;
+} garmini_output_t;
+
+void garmini_buffer_init(garmini_buffer_t *);
+void garmini_buffer_reserve(garmini_buffer_t *, size_t);
+void garmini_buffer_vprintf(garmini_buffer_t *, const char *, va_list);
+void garmini_buffer_printf(garmini_buffer_t *, const char *, ...);
+garmini_output_t *garmini_output_new(int, int, int, int, garmini_archive_t *);
+void garmini_output_file(garmini_output_t *, const char *, char *, size_t);
+void garmini_output_flush(garmini_output_t *);
+void garmini_output_commit(garmini_output_t *);
+void garmini_output_delete(garmini_output_t *);
+
+#endif
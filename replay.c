@@ -0,0 +1,220 @@
+/*
+
+   garmini - download track log from Garmin GPSs
+   Copyright (C) 2007  Tom Payne
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "garmini.h"
+#include "replay.h"
+
+/* A replay plays the device's side of a communication log written with -l.
+ * Received packets are delivered in order, but only up to the next packet
+ * that we sent in the original session; until that packet is written again
+ * every read times out.  Time is virtual: timeouts and the transmission time
+ * of each byte at 9600 baud are slept on the virtual clock.
+ *
+ * Like a device, a replay recovers from errors on the link, so that faults
+ * can be injected into it.  A NAK brings the last packet again, and so does
+ * waiting GARMIN_REPLAY_RETRANSMIT for the ACK to it.  Sending our last
+ * packet again brings the reply to it again. */
+
+#define GARMIN_REPLAY_USEC_PER_BYTE (10 * 1000000 / 9600)
+#define GARMIN_REPLAY_RETRANSMIT (1000 * 1000)
+
+typedef struct {
+	int direction;
+	int size;
+	unsigned char data[GARMIN_FRAME_SIZE];
+} garmin_replay_entry_t;
+
+typedef struct {
+	garmin_transport_t transport;
+	garmin_clock_t clock;
+	int nentries;
+	garmin_replay_entry_t *entries;
+	int index;
+	int offset;
+	int last_read;
+	int last_written;
+	int blocked;
+	int64_t blocked_since;
+	int diverged;
+} garmin_replay_t;
+
+static int garmin_replay_is_ack(const garmin_replay_entry_t *entry)
+{
+	return entry->data[1] == Pid_Ack_Byte;
+}
+
+/* Whether the replay waits for our ACK to the packet that it sent last. */
+static int garmin_replay_awaits_ack(const garmin_replay_t *replay)
+{
+	int i = replay->index;
+	return 0 < i && i < replay->nentries && replay->entries[i].direction == '>' && garmin_replay_is_ack(replay->entries + i) && replay->entries[i - 1].direction == '<' && !garmin_replay_is_ack(replay->entries + i - 1);
+}
+
+static void garmin_replay_rewind(garmin_replay_t *replay, int index)
+{
+	replay->index = index;
+	replay->offset = 0;
+	replay->blocked = -1;
+}
+
+static int garmin_replay_read(garmin_transport_t *transport, unsigned char *buf, int size, int64_t timeout)
+{
+	garmin_replay_t *replay = (garmin_replay_t *) transport;
+	if (replay->index == replay->nentries || replay->entries[replay->index].direction != '<') {
+		int64_t now = transport->clock->now(transport->clock);
+		if (replay->blocked != replay->index) {
+			replay->blocked = replay->index;
+			replay->blocked_since = now;
+		}
+		if (now - replay->blocked_since < GARMIN_REPLAY_RETRANSMIT || !garmin_replay_awaits_ack(replay)) {
+			transport->clock->sleep(transport->clock, timeout);
+			return 0;
+		}
+		garmin_replay_rewind(replay, replay->index - 1);
+	}
+	replay->last_read = replay->index;
+	garmin_replay_entry_t *entry = replay->entries + replay->index;
+	int n = entry->size - replay->offset;
+	if (n > size)
+		n = size;
+	memcpy(buf, entry->data + replay->offset, n);
+	replay->offset += n;
+	if (replay->offset == entry->size) {
+		++replay->index;
+		replay->offset = 0;
+	}
+	transport->clock->sleep(transport->clock, n * GARMIN_REPLAY_USEC_PER_BYTE);
+	return n;
+}
+
+static void garmin_replay_write(garmin_transport_t *transport, const unsigned char *buf, int size)
+{
+	garmin_replay_t *replay = (garmin_replay_t *) transport;
+	transport->clock->sleep(transport->clock, size * GARMIN_REPLAY_USEC_PER_BYTE);
+	garmin_replay_entry_t *entry = replay->entries + replay->index;
+	if (replay->index < replay->nentries && entry->direction == '>' && entry->size == size && !memcmp(entry->data, buf, size)) {
+		replay->last_written = replay->index++;
+		return;
+	}
+	if (size > 1 && buf[1] == Pid_Nak_Byte && replay->last_read >= 0) {
+		garmin_replay_rewind(replay, replay->last_read);
+		return;
+	}
+	if (replay->last_written >= 0 && replay->entries[replay->last_written].size == size && !memcmp(replay->entries[replay->last_written].data, buf, size)) {
+		garmin_replay_rewind(replay, replay->last_written + 1);
+		return;
+	}
+	if (replay->index == replay->nentries || entry->direction != '>')
+		return;
+	replay->last_written = replay->index++;
+	if (!replay->diverged && (entry->size != size || memcmp(entry->data, buf, size))) {
+		warning("%s: session diverges from the log", transport->name);
+		replay->diverged = 1;
+	}
+}
+
+static void garmin_replay_delete(garmin_transport_t *transport)
+{
+	garmin_replay_t *replay = (garmin_replay_t *) transport;
+	free(replay->entries);
+	free(replay);
+}
+
+/* Parses the quoted packet data written by print_string(). */
+static int garmin_replay_parse_data(const char *p, unsigned char *data)
+{
+	int size = 0;
+	int n;
+	while (*p && *p != '"') {
+		int c = *p++;
+		if (c == '\\') {
+			switch (c = *p++) {
+				case 'a': c = '\a'; break;
+				case 'b': c = '\b'; break;
+				case 'f': c = '\f'; break;
+				case 'n': c = '\n'; break;
+				case 'r': c = '\r'; break;
+				case 't': c = '\t'; break;
+				case 'v': c = '\v'; break;
+				case 'x':
+					for (c = 0, n = 0; n < 2 && isxdigit(*p); ++n, ++p)
+						c = 16 * c + (isdigit(*p) ? *p - '0' : tolower(*p) - 'a' + 10);
+					break;
+				case 0:
+					return -1;
+			}
+		}
+		if (size == 255)
+			return -1;
+		data[size++] = c;
+	}
+	return *p == '"' ? size : -1;
+}
+
+garmin_transport_t *garmin_replay_new(const char *filename)
+{
+	garmin_replay_t *replay = alloc(sizeof(garmin_replay_t));
+	replay->transport.read = garmin_replay_read;
+	replay->transport.write = garmin_replay_write;
+	replay->transport.delete = garmin_replay_delete;
+	replay->transport.read_packet = 0;
+	replay->transport.write_packet = 0;
+	replay->transport.name = filename;
+	replay->transport.clock = &replay->clock;
+	replay->transport.baud = 9600;
+	garmin_clock_init_virtual(&replay->clock);
+	replay->last_read = -1;
+	replay->last_written = -1;
+	replay->blocked = -1;
+	FILE *file = fopen(filename, "r");
+	if (!file)
+		error("fopen: %s: %s", filename, strerror(errno));
+	int capacity = 0;
+	char line[2048];
+	int lineno = 0;
+	while (fgets(line, sizeof line, file)) {
+		++lineno;
+		char *p = strstr(line, " { ");
+		if (!p || p == line || (p[-1] != '<' && p[-1] != '>'))
+			continue;
+		garmin_packet_t packet;
+		int n;
+		if (sscanf(p, " { %d, \"%n", &packet.id, &n) != 1 || (packet.size = garmin_replay_parse_data(p + n, packet.data)) == -1)
+			error("%s:%d: invalid packet", filename, lineno);
+		if (replay->nentries == capacity) {
+			capacity = capacity ? 2 * capacity : 1024;
+			replay->entries = realloc(replay->entries, capacity * sizeof(garmin_replay_entry_t));
+			if (!replay->entries)
+				DIE("realloc", errno);
+		}
+		garmin_replay_entry_t *entry = replay->entries + replay->nentries++;
+		entry->direction = p[-1];
+		entry->size = garmin_frame_packet(&packet, entry->data);
+	}
+	if (ferror(file))
+		error("%s: %s", filename, strerror(errno));
+	fclose(file);
+	return &replay->transport;
+}
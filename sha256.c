@@ -0,0 +1,160 @@
+/*
+
+   garmini - download track log from Garmin GPSs
+   Copyright (C) 2007  Tom Payne
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <string.h>
+
+#include "sha256.h"
+
+static const uint32_t k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(sha256_t *sha256, const unsigned char *p)
+{
+	uint32_t w[64];
+	int i;
+	for (i = 0; i < 16; ++i)
+		w[i] = (uint32_t) p[4 * i] << 24 | (uint32_t) p[4 * i + 1] << 16 | (uint32_t) p[4 * i + 2] << 8 | p[4 * i + 3];
+	for (i = 16; i < 64; ++i) {
+		uint32_t s0 = ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		uint32_t s1 = ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+	uint32_t a = sha256->state[0], b = sha256->state[1], c = sha256->state[2], d = sha256->state[3];
+	uint32_t e = sha256->state[4], f = sha256->state[5], g = sha256->state[6], h = sha256->state[7];
+	for (i = 0; i < 64; ++i) {
+		uint32_t t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+		uint32_t t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+	sha256->state[0] += a;
+	sha256->state[1] += b;
+	sha256->state[2] += c;
+	sha256->state[3] += d;
+	sha256->state[4] += e;
+	sha256->state[5] += f;
+	sha256->state[6] += g;
+	sha256->state[7] += h;
+}
+
+void sha256_init(sha256_t *sha256)
+{
+	static const uint32_t h[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+	memcpy(sha256->state, h, sizeof h);
+	sha256->length = 0;
+	sha256->n = 0;
+}
+
+void sha256_update(sha256_t *sha256, const void *data, size_t size)
+{
+	const unsigned char *p = data;
+	sha256->length += size;
+	if (sha256->n) {
+		size_t n = SHA256_BLOCK_SIZE - sha256->n;
+		if (n > size)
+			n = size;
+		memcpy(sha256->block + sha256->n, p, n);
+		sha256->n += n;
+		p += n;
+		size -= n;
+		if (sha256->n < SHA256_BLOCK_SIZE)
+			return;
+		sha256_block(sha256, sha256->block);
+		sha256->n = 0;
+	}
+	for (; size >= SHA256_BLOCK_SIZE; p += SHA256_BLOCK_SIZE, size -= SHA256_BLOCK_SIZE)
+		sha256_block(sha256, p);
+	memcpy(sha256->block, p, size);
+	sha256->n = size;
+}
+
+void sha256_final(sha256_t *sha256, unsigned char *digest)
+{
+	uint64_t bits = sha256->length * 8;
+	sha256->block[sha256->n++] = 0x80;
+	if (sha256->n > SHA256_BLOCK_SIZE - 8) {
+		memset(sha256->block + sha256->n, 0, SHA256_BLOCK_SIZE - sha256->n);
+		sha256_block(sha256, sha256->block);
+		sha256->n = 0;
+	}
+	memset(sha256->block + sha256->n, 0, SHA256_BLOCK_SIZE - 8 - sha256->n);
+	int i;
+	for (i = 0; i < 8; ++i)
+		sha256->block[SHA256_BLOCK_SIZE - 1 - i] = bits >> (8 * i);
+	sha256_block(sha256, sha256->block);
+	for (i = 0; i < 8; ++i) {
+		digest[4 * i] = sha256->state[i] >> 24;
+		digest[4 * i + 1] = sha256->state[i] >> 16;
+		digest[4 * i + 2] = sha256->state[i] >> 8;
+		digest[4 * i + 3] = sha256->state[i];
+	}
+}
+
+void hmac_sha256_init(hmac_sha256_t *hmac, const void *key, size_t size)
+{
+	unsigned char pad[SHA256_BLOCK_SIZE];
+	memset(pad, 0, sizeof pad);
+	if (size > SHA256_BLOCK_SIZE) {
+		sha256_t sha256;
+		sha256_init(&sha256);
+		sha256_update(&sha256, key, size);
+		sha256_final(&sha256, pad);
+	} else {
+		memcpy(pad, key, size);
+	}
+	int i;
+	for (i = 0; i < SHA256_BLOCK_SIZE; ++i)
+		pad[i] ^= 0x36;
+	sha256_init(&hmac->inner);
+	sha256_update(&hmac->inner, pad, sizeof pad);
+	for (i = 0; i < SHA256_BLOCK_SIZE; ++i)
+		pad[i] ^= 0x36 ^ 0x5c;
+	sha256_init(&hmac->outer);
+	sha256_update(&hmac->outer, pad, sizeof pad);
+}
+
+void hmac_sha256_update(hmac_sha256_t *hmac, const void *data, size_t size)
+{
+	sha256_update(&hmac->inner, data, size);
+}
+
+void hmac_sha256_final(hmac_sha256_t *hmac, unsigned char *digest)
+{
+	unsigned char inner[SHA256_DIGEST_SIZE];
+	sha256_final(&hmac->inner, inner);
+	sha256_update(&hmac->outer, inner, sizeof inner);
+	sha256_final(&hmac->outer, digest);
+}
@@ -0,0 +1,49 @@
+/*
+
+   garmini - download track log from Garmin GPSs
+   Copyright (C) 2007  Tom Payne
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SHA256_BLOCK_SIZE 64
+#define SHA256_DIGEST_SIZE 32
+
+typedef struct {
+	uint32_t state[8];
+	uint64_t length;
+	int n;
+	unsigned char block[SHA256_BLOCK_SIZE];
+} sha256_t;
+
+typedef struct {
+	sha256_t inner;
+	sha256_t outer;
+} hmac_sha256_t;
+
+void sha256_init(sha256_t *);
+void sha256_update(sha256_t *, const void *, size_t);
+void sha256_final(sha256_t *, unsigned char *);
+void hmac_sha256_init(hmac_sha256_t *, const void *, size_t);
+void hmac_sha256_update(hmac_sha256_t *, const void *, size_t);
+void hmac_sha256_final(hmac_sha256_t *, unsigned char *);
+
+#endif
@@ -0,0 +1,286 @@
+/*
+
+   garmini - download track log from Garmin GPSs
+   Copyright (C) 2007  Tom Payne
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "garmini.h"
+#include "tcp.h"
+
+/* A serial port reached through a device server.  Nagle's algorithm is
+ * disabled, and every write, which is always one whole packet, goes out as a
+ * single segment, so that an ACK is not held back waiting for more data.
+ *
+ * With RFC 2217 the stream is telnet: the port is set to 9600 8N1 with the
+ * COM-PORT-OPTION, 0xff is doubled in data, and the server's own commands are
+ * stripped from what is read, refusing any option that it offers. */
+
+enum {
+	SE   = 240,
+	SB   = 250,
+	WILL = 251,
+	WONT = 252,
+	DO   = 253,
+	DONT = 254,
+	IAC  = 255
+};
+
+enum {
+	TELOPT_BINARY   = 0,
+	TELOPT_COM_PORT = 44
+};
+
+enum {
+	SET_BAUDRATE = 1,
+	SET_DATASIZE = 2,
+	SET_PARITY   = 3,
+	SET_STOPSIZE = 4
+};
+
+enum {
+	TELNET_DATA,
+	TELNET_IAC,
+	TELNET_OPTION,
+	TELNET_SB,
+	TELNET_SB_IAC
+};
+
+typedef struct {
+	garmin_transport_t transport;
+	int fd;
+	int rfc2217;
+	int state;
+	int command;
+} garmin_tcp_t;
+
+static void garmin_tcp_send(garmin_tcp_t *tcp, const unsigned char *buf, int size)
+{
+	while (size) {
+		int rc = send(tcp->fd, buf, size, MSG_NOSIGNAL);
+		if (rc == -1) {
+			if (errno == EINTR)
+				continue;
+			error("send: %s: %s", tcp->transport.name, strerror(errno));
+		}
+		buf += rc;
+		size -= rc;
+	}
+}
+
+static void garmin_tcp_option(garmin_tcp_t *tcp, int command, int option)
+{
+	unsigned char buf[3] = { IAC, command, option };
+	garmin_tcp_send(tcp, buf, sizeof buf);
+}
+
+/* Strips telnet commands from buf in place, returning the number of data
+ * bytes left. */
+static int garmin_tcp_telnet(garmin_tcp_t *tcp, unsigned char *buf, int size)
+{
+	unsigned char *p = buf;
+	int i;
+	for (i = 0; i < size; ++i) {
+		int c = buf[i];
+		switch (tcp->state) {
+			case TELNET_DATA:
+				if (c == IAC)
+					tcp->state = TELNET_IAC;
+				else
+					*p++ = c;
+				break;
+			case TELNET_IAC:
+				tcp->state = TELNET_DATA;
+				if (c == IAC) {
+					*p++ = c;
+				} else if (c == SB) {
+					tcp->state = TELNET_SB;
+				} else if (WILL <= c && c <= DONT) {
+					tcp->command = c;
+					tcp->state = TELNET_OPTION;
+				}
+				break;
+			case TELNET_OPTION:
+				tcp->state = TELNET_DATA;
+				if (c == TELOPT_BINARY || (c == TELOPT_COM_PORT && tcp->command == DO))
+					break;
+				if (tcp->command == WILL)
+					garmin_tcp_option(tcp, DONT, c);
+				else if (tcp->command == DO)
+					garmin_tcp_option(tcp, WONT, c);
+				break;
+			case TELNET_SB:
+				if (c == IAC)
+					tcp->state = TELNET_SB_IAC;
+				break;
+			case TELNET_SB_IAC:
+				tcp->state = c == SE ? TELNET_DATA : TELNET_SB;
+				break;
+		}
+	}
+	return p - buf;
+}
+
+static int garmin_tcp_read(garmin_transport_t *transport, unsigned char *buf, int size, int64_t timeout_usec)
+{
+	garmin_tcp_t *tcp = (garmin_tcp_t *) transport;
+	int64_t deadline = transport->clock->now(transport->clock) + timeout_usec;
+	while (1) {
+		fd_set readfds;
+		FD_ZERO(&readfds);
+		FD_SET(tcp->fd, &readfds);
+		int64_t remaining = deadline - transport->clock->now(transport->clock);
+		if (remaining < 0)
+			remaining = 0;
+		struct timeval timeout;
+		timeout.tv_sec = remaining / 1000000;
+		timeout.tv_usec = remaining % 1000000;
+		int rc = select(tcp->fd + 1, &readfds, 0, 0, &timeout);
+		if (rc == -1) {
+			if (errno == EINTR)
+				continue;
+			DIE("select", errno);
+		}
+		if (rc == 0)
+			return 0;
+		int n = recv(tcp->fd, buf, size, 0);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			error("recv: %s: %s", transport->name, strerror(errno));
+		}
+		if (n == 0)
+			error("%s: connection closed", transport->name);
+		if (tcp->rfc2217)
+			n = garmin_tcp_telnet(tcp, buf, n);
+		if (n)
+			return n;
+	}
+}
+
+static void garmin_tcp_write(garmin_transport_t *transport, const unsigned char *buf, int size)
+{
+	garmin_tcp_t *tcp = (garmin_tcp_t *) transport;
+	if (!tcp->rfc2217) {
+		garmin_tcp_send(tcp, buf, size);
+		return;
+	}
+	unsigned char escaped[2 * GARMIN_FRAME_SIZE];
+	unsigned char *p = escaped;
+	int i;
+	for (i = 0; i < size; ++i) {
+		if (p - escaped + 2 > (int) sizeof escaped) {
+			garmin_tcp_send(tcp, escaped, p - escaped);
+			p = escaped;
+		}
+		if (buf[i] == IAC)
+			*p++ = IAC;
+		*p++ = buf[i];
+	}
+	garmin_tcp_send(tcp, escaped, p - escaped);
+}
+
+static void garmin_tcp_delete(garmin_transport_t *transport)
+{
+	garmin_tcp_t *tcp = (garmin_tcp_t *) transport;
+	if (close(tcp->fd) == -1)
+		DIE("close", errno);
+	free(tcp);
+}
+
+/* Sets the remote port to 9600 8N1. */
+static void garmin_tcp_rfc2217(garmin_tcp_t *tcp)
+{
+	static const unsigned char negotiation[] = {
+		IAC, WILL, TELOPT_BINARY,
+		IAC, DO, TELOPT_BINARY,
+		IAC, WILL, TELOPT_COM_PORT,
+		IAC, SB, TELOPT_COM_PORT, SET_BAUDRATE, 0, 0, 9600 >> 8, 9600 & 0xff, IAC, SE,
+		IAC, SB, TELOPT_COM_PORT, SET_DATASIZE, 8, IAC, SE,
+		IAC, SB, TELOPT_COM_PORT, SET_PARITY, 1, IAC, SE,
+		IAC, SB, TELOPT_COM_PORT, SET_STOPSIZE, 1, IAC, SE
+	};
+	garmin_tcp_send(tcp, negotiation, sizeof negotiation);
+}
+
+/* address is HOST:PORT. */
+garmin_transport_t *garmin_tcp_new(const char *address, int rfc2217)
+{
+	const char *colon = strrchr(address, ':');
+	if (!colon || colon == address || !colon[1])
+		error("%s: expected HOST:PORT", address);
+	char *host = strndup(address, colon - address);
+	if (!host)
+		DIE("strndup", errno);
+	if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+		memmove(host, host + 1, strlen(host) - 2);
+		host[strlen(host) - 2] = '\0';
+	}
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	struct addrinfo *addrinfo;
+	int rc = getaddrinfo(host, colon + 1, &hints, &addrinfo);
+	if (rc)
+		error("%s: %s", address, gai_strerror(rc));
+	garmin_tcp_t *tcp = alloc(sizeof(garmin_tcp_t));
+	tcp->fd = -1;
+	int _errno = 0;
+	struct addrinfo *ai;
+	for (ai = addrinfo; ai && tcp->fd == -1; ai = ai->ai_next) {
+		tcp->fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (tcp->fd == -1) {
+			_errno = errno;
+			continue;
+		}
+		if (connect(tcp->fd, ai->ai_addr, ai->ai_addrlen) == -1) {
+			_errno = errno;
+			close(tcp->fd);
+			tcp->fd = -1;
+		}
+	}
+	freeaddrinfo(addrinfo);
+	free(host);
+	if (tcp->fd == -1)
+		error("connect: %s: %s", address, strerror(_errno));
+	int one = 1;
+	if (setsockopt(tcp->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one) == -1)
+		DIE("setsockopt", errno);
+	tcp->transport.read = garmin_tcp_read;
+	tcp->transport.write = garmin_tcp_write;
+	tcp->transport.delete = garmin_tcp_delete;
+	tcp->transport.read_packet = 0;
+	tcp->transport.write_packet = 0;
+	tcp->transport.name = address;
+	tcp->transport.clock = &garmin_real_clock;
+	tcp->transport.baud = rfc2217 ? 9600 : 0;
+	tcp->rfc2217 = rfc2217;
+	tcp->state = TELNET_DATA;
+	if (rfc2217)
+		garmin_tcp_rfc2217(tcp);
+	return &tcp->transport;
+}
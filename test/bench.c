@@ -0,0 +1,274 @@
+/*
+
+   garmini - download track log from Garmin GPSs
+   Copyright (C) 2007  Tom Payne
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../cpu.h"
+#include "../garmini.h"
+#include "../gzip.h"
+#include "../output.h"
+#include "../track.h"
+
+/* Benchmarks the output path: gzip compression speed and ratio at each
+ * kernel level the CPU supports, on a tracklog file or, by default, a
+ * synthetic IGC file of about the size of a full Garmin track log's worth of
+ * flights, each kernel's output checked with gzip -d; altitude smoothing at
+ * each level; and then how many files a second are written, with stdio and
+ * with io_uring, in a temporary directory.  Each measurement repeats until it
+ * has run for at least BENCH_SECONDS. */
+
+#define BENCH_SECONDS 1.0
+#define BENCH_FILE_SIZE (64 * 1024)
+
+const char *program_name = "bench";
+
+static double bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* B records of a flight with a fix every second, wandering as a real one
+ * does, so that the text compresses about as well as a real IGC file. */
+static void bench_igc(garmini_buffer_t *buffer, size_t size)
+{
+	garmini_buffer_printf(buffer, "AXGD000\r\nHFDTE010190\r\n");
+	double lat = 46.0, lon = 7.0, alt = 1000.0;
+	int t = 10 * 3600;
+	while (buffer->size < size) {
+		lat += 0.0001 * sin(t / 300.0);
+		lon += 0.0001 * cos(t / 700.0);
+		alt += 2.0 * sin(t / 45.0) + 0.3 * sin(t / 7.0);
+		int s = t % 86400;
+		garmini_buffer_printf(buffer, "B%02d%02d%02d%02d%05dN%03d%05dEA%05d%05d\r\n", s / 3600, s / 60 % 60, s % 60, (int) lat, (int) (60000 * (lat - (int) lat)), (int) lon, (int) (60000 * (lon - (int) lon)), (int) alt, (int) alt + 12);
+		++t;
+	}
+}
+
+static void bench_read(garmini_buffer_t *buffer, const char *filename)
+{
+	FILE *file = fopen(filename, "r");
+	if (!file)
+		error("fopen: %s: %s", filename, strerror(errno));
+	char buf[65536];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof buf, file)) > 0) {
+		garmini_buffer_reserve(buffer, buffer->size + n);
+		memcpy(buffer->data + buffer->size, buf, n);
+		buffer->size += n;
+	}
+	if (ferror(file))
+		error("%s: %s", filename, strerror(errno));
+	fclose(file);
+}
+
+/* Checks that gzip -d gives back the input from the compressed output. */
+static void bench_gunzip(const garmini_buffer_t *input, const garmini_buffer_t *output)
+{
+	char filename[] = "/tmp/bench.XXXXXX";
+	int fd = mkstemp(filename);
+	if (fd == -1)
+		DIE("mkstemp", errno);
+	if (write(fd, output->data, output->size) != (ssize_t) output->size)
+		DIE("write", errno);
+	close(fd);
+	char command[64];
+	snprintf(command, sizeof command, "gzip -dc %s", filename);
+	FILE *file = popen(command, "r");
+	if (!file)
+		DIE("popen", errno);
+	garmini_buffer_t decompressed;
+	garmini_buffer_init(&decompressed);
+	char buf[65536];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof buf, file)) > 0) {
+		garmini_buffer_reserve(&decompressed, decompressed.size + n);
+		memcpy(decompressed.data + decompressed.size, buf, n);
+		decompressed.size += n;
+	}
+	int status = pclose(file);
+	unlink(filename);
+	if (status != 0)
+		error("gzip %s: gzip -d failed", garmini_cpu_name(garmini_cpu()));
+	if (decompressed.size != input->size || memcmp(decompressed.data, input->data, input->size))
+		error("gzip %s: output does not decompress to the input", garmini_cpu_name(garmini_cpu()));
+	free(decompressed.data);
+}
+
+static void bench_gzip(const garmini_buffer_t *input)
+{
+	garmini_buffer_t output;
+	int runs = 0;
+	double start = bench_now(), elapsed;
+	do {
+		if (runs)
+			free(output.data);
+		garmini_buffer_init(&output);
+		gzip_buffer(&output, input->data, input->size);
+		++runs;
+	} while ((elapsed = bench_now() - start) < BENCH_SECONDS);
+	size_t compressed = output.size;
+	bench_gunzip(input, &output);
+	free(output.data);
+	printf("gzip %-8s %8.1f MB/s, ratio %.2f\n", garmini_cpu_name(garmini_cpu()), runs * input->size / elapsed / 1e6, (double) input->size / compressed);
+}
+
+/* A full Garmin track log of 10000 points, a fix every second, climbing and
+ * sinking with noise on the altimeter, smoothed as -k does. */
+#define BENCH_TRACK_POINTS 10000
+
+static void bench_smooth(void)
+{
+	garmin_arena_t *arena = garmin_arena_new();
+	garmini_track_t *track = garmini_track_new(arena, BENCH_TRACK_POINTS);
+	int i;
+	for (i = 0; i < BENCH_TRACK_POINTS; ++i) {
+		garmin_trk_point_t trk_point;
+		memset(&trk_point, 0, sizeof trk_point);
+		trk_point.time = 10 * 3600 + i;
+		trk_point.alt = 1000.0 + 800.0 * sin(i / 500.0) + 3.0 * sin(i * 1.7);
+		trk_point.valid = 1;
+		garmini_track_push(track, &trk_point);
+	}
+	float *alt = garmin_arena_alloc(arena, BENCH_TRACK_POINTS * sizeof(float));
+	int runs = 0;
+	double start = bench_now(), elapsed;
+	do {
+		garmini_track_smoothed(track, alt);
+		++runs;
+	} while ((elapsed = bench_now() - start) < BENCH_SECONDS);
+	printf("smooth %-8s %8.1f Mpoints/s\n", garmini_cpu_name(garmini_cpu()), (double) runs * BENCH_TRACK_POINTS / elapsed / 1e6);
+	garmin_arena_delete(arena);
+}
+
+static const char *bench_durability_names[] = { "none", "group", "strict" };
+
+static void bench_output(const garmini_buffer_t *input, int nfiles, int io_uring, int durability)
+{
+	size_t size = input->size < BENCH_FILE_SIZE ? input->size : BENCH_FILE_SIZE;
+	int files = 0;
+	int uring = 1;
+	double start = bench_now(), elapsed;
+	do {
+		garmini_output_t *output = garmini_output_new(io_uring, durability, 0, 0, 0);
+		uring = output->uring != 0;
+		int i;
+		for (i = 0; i < nfiles; ++i) {
+			char filename[32];
+			snprintf(filename, sizeof filename, "bench-%05d.IGC", i);
+			char *data = alloc(size);
+			memcpy(data, input->data + (size_t) i * size % (input->size - size + 1), size);
+			garmini_output_file(output, filename, data, size);
+		}
+		garmini_output_delete(output);
+		files += nfiles;
+	} while ((elapsed = bench_now() - start) < BENCH_SECONDS);
+	if (io_uring && !uring)
+		printf("output io_uring  %-6s   unavailable\n", bench_durability_names[durability]);
+	else
+		printf("output %-8s %-6s %8.0f files/s\n", io_uring ? "io_uring" : "stdio", bench_durability_names[durability], files / elapsed);
+}
+
+static void bench_unlink(int nfiles)
+{
+	int i;
+	for (i = 0; i < nfiles; ++i) {
+		char filename[32];
+		snprintf(filename, sizeof filename, "bench-%05d.IGC", i);
+		unlink(filename);
+	}
+}
+
+static void usage(void)
+{
+	printf("%s - benchmark garmini's output path\n"
+			"Usage: %s [-n FILES] [-s MB] [FILE]\n"
+			"Options:\n"
+			"\t-h\t\tshow some help\n"
+			"\t-n FILES\tfiles written per batch (default 256)\n"
+			"\t-s MB\t\tsize of the synthetic IGC file (default 8)\n"
+			"FILE is compressed instead of the synthetic IGC file if given.\n",
+		program_name, program_name);
+}
+
+int main(int argc, char *argv[])
+{
+	double size = 8.0;
+	int nfiles = 256;
+	int c;
+	while ((c = getopt(argc, argv, "hn:s:")) != -1) {
+		switch (c) {
+			case 'h':
+				usage();
+				exit(EXIT_SUCCESS);
+			case 'n':
+				nfiles = atoi(optarg);
+				if (nfiles <= 0)
+					error("invalid number of files '%s'", optarg);
+				break;
+			case 's':
+				size = atof(optarg);
+				if (size <= 0.0)
+					error("invalid size '%s'", optarg);
+				break;
+			default:
+				exit(EXIT_FAILURE);
+		}
+	}
+	garmini_buffer_t input;
+	garmini_buffer_init(&input);
+	if (optind < argc)
+		bench_read(&input, argv[optind]);
+	else
+		bench_igc(&input, size * 1e6);
+	printf("input: %.1f MB %s\n", input.size / 1e6, optind < argc ? argv[optind] : "synthetic IGC");
+	int level;
+	for (level = GARMINI_CPU_SCALAR; level <= garmini_cpu_detect(); ++level) {
+		garmini_cpu_force(level);
+		bench_gzip(&input);
+	}
+	for (level = GARMINI_CPU_SCALAR; level <= garmini_cpu_detect(); ++level) {
+		garmini_cpu_force(level);
+		bench_smooth();
+	}
+	char directory[] = "/tmp/bench.XXXXXX";
+	if (!mkdtemp(directory))
+		DIE("mkdtemp", errno);
+	if (chdir(directory) == -1)
+		DIE("chdir", errno);
+	int durability;
+	for (durability = GARMINI_DURABILITY_NONE; durability <= GARMINI_DURABILITY_GROUP; ++durability) {
+		bench_output(&input, nfiles, 0, durability);
+		bench_output(&input, nfiles, 1, durability);
+	}
+	bench_unlink(nfiles);
+	if (rmdir(directory) == -1)
+		DIE("rmdir", errno);
+	free(input.data);
+	return 0;
+}
@@ -0,0 +1,94 @@
+#!/bin/sh
+#
+# Downloads from a simulated GPS with faults injected into the link, SEEDS
+# times for each fault profile, and reports the success rate, a download
+# that matches the one without faults, and the mean download rate.  Fails if
+# any profile succeeds less than MIN_SUCCESS percent of the time.
+#
+# An old device, which sends no Protocol_Array, must pass the link test and
+# give the same download.
+#
+# A replay runs on a virtual clock, so two replays of the same log with the
+# same faults must agree on the track log, the -J progress and the link
+# statistics of -X.
+#
+# Bit flips are kept rare: the link's 8-bit checksum misses some frames with
+# several flipped bits, which recovery cannot help.
+#
+# Usage: test/faulttest.sh [SEEDS [POINTS]]
+
+SEEDS=${1:-${SEEDS:-10}}
+POINTS=${2:-${POINTS:-1000}}
+MIN_SUCCESS=${MIN_SUCCESS:-100}
+MIXED=flip=0.0003,drop=0.01,stall=0.01,short=0.1
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -Rf "$dir"' EXIT
+
+download() {
+	test/gsim -p "$1" -n "$POINTS" -T 200000 -- ./garmini -q -X $2 igc > "$dir/igc" 2> "$dir/stats"
+}
+
+printf "%-44s %9s %10s\n" profile success records/s
+rates=0
+for format in 300 301 302 303 304; do
+	if ! download $format ""; then
+		cat "$dir/stats"
+		echo "faulttest: FAIL: D$format without faults"
+		exit 1
+	fi
+	md5sum < "$dir/igc" > "$dir/D$format.md5"
+	rates=$((rates + $(sed -n 's/.* \([0-9]*\) records\/s$/\1/p' "$dir/stats")))
+done
+printf "%-44s %4d/%-4d %10d\n" none 5 5 $((rates / 5))
+
+if ! test/gsim -o -n "$POINTS" -- ./garmini -q linktest igc > "$dir/old" ||
+	! grep -v '^garmini: ' "$dir/old" | md5sum | cmp -s - "$dir/D300.md5"; then
+	echo "faulttest: FAIL: device without a Protocol_Array"
+	exit 1
+fi
+
+replay() {
+	./garmini -q -X -J 3 -F seed=1,$MIXED -r "$dir/log" igc > "$dir/igc$1" 3> "$dir/progress$1" 2> "$dir/stats" &&
+	grep -v 'records/s$\|^garmini: cpu ' "$dir/stats" > "$dir/stats$1"
+}
+
+if ! test/gsim -p 302 -n "$POINTS" -- ./garmini -q -l "$dir/log" igc > /dev/null || ! replay 1 || ! replay 2; then
+	cat "$dir/stats"
+	echo "faulttest: FAIL: replay"
+	exit 1
+fi
+if ! md5sum < "$dir/igc1" | cmp -s - "$dir/D302.md5"; then
+	echo "faulttest: FAIL: replay does not match the download"
+	exit 1
+fi
+for output in igc progress stats; do
+	if ! cmp "$dir/${output}1" "$dir/${output}2"; then
+		echo "faulttest: FAIL: replays differ"
+		exit 1
+	fi
+done
+
+status=0
+for profile in flip=0.0003 drop=0.01 stall=0.01 short=0.1 $MIXED; do
+	successes=0
+	rates=0
+	seed=1
+	while [ $seed -le "$SEEDS" ]; do
+		format=$((300 + seed % 5))
+		if download $format "-F seed=$seed,$profile" && md5sum < "$dir/igc" | cmp -s - "$dir/D$format.md5"; then
+			successes=$((successes + 1))
+			rates=$((rates + $(sed -n 's/.* \([0-9]*\) records\/s$/\1/p' "$dir/stats")))
+		fi
+		seed=$((seed + 1))
+	done
+	printf "%-44s %4d/%-4d %10d\n" "$profile" $successes "$SEEDS" $((successes ? rates / successes : 0))
+	if [ $((100 * successes)) -lt $((MIN_SUCCESS * SEEDS)) ]; then
+		status=1
+	fi
+done
+if [ $status -ne 0 ]; then
+	echo "faulttest: FAIL: success below ${MIN_SUCCESS}%"
+	exit 1
+fi
+echo "faulttest: PASS"
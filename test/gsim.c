@@ -0,0 +1,869 @@
+/*
+
+   garmini - download track log from Garmin GPSs
+   Copyright (C) 2007  Tom Payne
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/* gsim simulates Garmin GPSs, so that garmini can be tested without any
+ * hardware.  It creates the devices on pseudo-terminals, runs a command with
+ * a "-d DEVICE" option for each inserted after the command's name, and exits
+ * with the command's status, so that
+ *
+ *   test/gsim -c 64 -p mix -- ./garmini -X download
+ *
+ * downloads from 64 devices at once.  Each device speaks the serial link
+ * protocol (L001, A010) and holds a track log of two flights in one of the
+ * track point formats D300 to D304.  Like a real device, it sends one packet
+ * at a time and waits for the ACK, sending the packet again on a NAK or when
+ * no ACK comes within its retransmission timeout.
+ *
+ * With -t or -R the devices are instead device servers listening on
+ * localhost, speaking raw TCP or RFC 2217.  An RFC 2217 server offers options
+ * of its own, which must be refused, answers the COM-PORT-OPTION settings
+ * and, on exit, fails unless every port was set to 9600 8N1. */
+
+#define GSIM_START 600000000
+#define GSIM_QUIET (10 * 1000)
+#define GSIM_FRAME_TIMEOUT (1000 * 1000)
+#define GSIM_TIMEOUT (-1)
+#define GSIM_BAD (-2)
+#define GSIM_MIX 0
+
+enum {
+	GSIM_PTY,
+	GSIM_TCP,
+	GSIM_RFC2217
+};
+
+enum {
+	SE   = 240,
+	SB   = 250,
+	WILL = 251,
+	WONT = 252,
+	DO   = 253,
+	DONT = 254,
+	IAC  = 255
+};
+
+enum {
+	TELOPT_ECHO     =  1,
+	TELOPT_TTYPE    = 24,
+	TELOPT_COM_PORT = 44
+};
+
+enum {
+	SET_BAUDRATE = 1,
+	SET_DATASIZE = 2,
+	SET_PARITY   = 3,
+	SET_STOPSIZE = 4
+};
+
+enum {
+	TELNET_DATA,
+	TELNET_IAC,
+	TELNET_OPTION,
+	TELNET_SB,
+	TELNET_SB_IAC
+};
+
+enum {
+	DLE = 16,
+	ETX =  3
+};
+
+enum {
+	Pid_Ack_Byte         =   6,
+	Pid_Command_Data     =  10,
+	Pid_Xfer_Cmplt       =  12,
+	Pid_Nak_Byte         =  21,
+	Pid_Records          =  27,
+	Pid_Trk_Data         =  34,
+	Pid_Trk_Hdr          =  99,
+	Pid_Ext_Product_Data = 248,
+	Pid_Protocol_Array   = 253,
+	Pid_Product_Rqst     = 254,
+	Pid_Product_Data     = 255
+};
+
+enum {
+	Cmnd_Transfer_Trk = 6,
+	Cmnd_Turn_Off_Pwr = 8
+};
+
+typedef struct {
+	int id;
+	int size;
+	unsigned char data[255];
+} gsim_packet_t;
+
+typedef struct {
+	int index;
+	int transport;
+	int fd;
+	int slave;
+	int listener;
+	char *path;
+	int format;
+	int old;
+	int npoints;
+	int64_t latency;
+	int64_t stall;
+	int64_t retransmit;
+	gsim_packet_t last;
+	gsim_packet_t pending;
+	int has_pending;
+	int packets;
+	int retransmissions;
+	int naks;
+	int duplicates;
+	int state;
+	int command;
+	int nsb;
+	unsigned char sb[16];
+	long baudrate;
+	int datasize;
+	int parity;
+	int stopsize;
+	int refusals;
+	int next;
+	int end;
+	unsigned char buf[4096];
+	pthread_t thread;
+} gsim_device_t;
+
+static const char *program_name = "gsim";
+
+static void gsim_error(const char *format, ...)
+{
+	fprintf(stderr, "%s: ", program_name);
+	va_list ap;
+	va_start(ap, format);
+	vfprintf(stderr, format, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	exit(EXIT_FAILURE);
+}
+
+static int64_t gsim_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void gsim_sleep(int64_t usec)
+{
+	struct timespec ts;
+	ts.tv_sec = usec / 1000000;
+	ts.tv_nsec = usec % 1000000 * 1000;
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		;
+}
+
+static void gsim_send_raw(gsim_device_t *device, const unsigned char *buf, int size)
+{
+	while (size) {
+		int n;
+		if (device->transport == GSIM_PTY)
+			n = write(device->fd, buf, size);
+		else
+			n = send(device->fd, buf, size, MSG_NOSIGNAL);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && (errno == EPIPE || errno == ECONNRESET))
+			pthread_exit(0);
+		if (n == -1)
+			gsim_error("write: %s: %s", device->path, strerror(errno));
+		buf += n;
+		size -= n;
+	}
+}
+
+/* Answers a COM-PORT-OPTION setting with the value that it now has. */
+static void gsim_com_port(gsim_device_t *device)
+{
+	if (device->nsb < 3 || device->sb[0] != TELOPT_COM_PORT)
+		return;
+	const unsigned char *value = device->sb + 2;
+	switch (device->sb[1]) {
+		case SET_BAUDRATE:
+			if (device->nsb == 6)
+				device->baudrate = (long) value[0] << 24 | value[1] << 16 | value[2] << 8 | value[3];
+			break;
+		case SET_DATASIZE:
+			device->datasize = value[0];
+			break;
+		case SET_PARITY:
+			device->parity = value[0];
+			break;
+		case SET_STOPSIZE:
+			device->stopsize = value[0];
+			break;
+		default:
+			return;
+	}
+	unsigned char reply[2 * sizeof device->sb + 4];
+	unsigned char *p = reply;
+	*p++ = IAC;
+	*p++ = SB;
+	*p++ = TELOPT_COM_PORT;
+	*p++ = 100 + device->sb[1];
+	int i;
+	for (i = 2; i < device->nsb; ++i) {
+		if (device->sb[i] == IAC)
+			*p++ = IAC;
+		*p++ = device->sb[i];
+	}
+	*p++ = IAC;
+	*p++ = SE;
+	gsim_send_raw(device, reply, p - reply);
+}
+
+/* Strips telnet commands from buf in place, returning the number of data
+ * bytes left. */
+static int gsim_telnet(gsim_device_t *device, unsigned char *buf, int size)
+{
+	unsigned char *p = buf;
+	int i;
+	for (i = 0; i < size; ++i) {
+		int c = buf[i];
+		switch (device->state) {
+			case TELNET_DATA:
+				if (c == IAC)
+					device->state = TELNET_IAC;
+				else
+					*p++ = c;
+				break;
+			case TELNET_IAC:
+				device->state = TELNET_DATA;
+				if (c == IAC) {
+					*p++ = c;
+				} else if (c == SB) {
+					device->nsb = 0;
+					device->state = TELNET_SB;
+				} else if (WILL <= c && c <= DONT) {
+					device->command = c;
+					device->state = TELNET_OPTION;
+				}
+				break;
+			case TELNET_OPTION:
+				device->state = TELNET_DATA;
+				if ((device->command == DONT && c == TELOPT_ECHO) || (device->command == WONT && c == TELOPT_TTYPE))
+					++device->refusals;
+				break;
+			case TELNET_SB:
+				if (c == IAC)
+					device->state = TELNET_SB_IAC;
+				else if (device->nsb < (int) sizeof device->sb)
+					device->sb[device->nsb++] = c;
+				break;
+			case TELNET_SB_IAC:
+				if (c == SE) {
+					gsim_com_port(device);
+					device->state = TELNET_DATA;
+				} else {
+					if (device->nsb < (int) sizeof device->sb)
+						device->sb[device->nsb++] = c;
+					device->state = TELNET_SB;
+				}
+				break;
+		}
+	}
+	return p - buf;
+}
+
+/* Reads whatever has arrived, waiting until deadline, or for ever if it is
+ * negative, and returning zero if nothing came. */
+static int gsim_fill(gsim_device_t *device, int64_t deadline)
+{
+	while (1) {
+		int timeout = -1;
+		if (deadline >= 0) {
+			int64_t remaining = deadline - gsim_now();
+			if (remaining <= 0)
+				return 0;
+			timeout = (remaining + 999) / 1000;
+		}
+		struct pollfd pollfd;
+		pollfd.fd = device->fd;
+		pollfd.events = POLLIN;
+		int rc = poll(&pollfd, 1, timeout);
+		if (rc == -1 && errno != EINTR)
+			gsim_error("poll: %s", strerror(errno));
+		if (rc <= 0)
+			continue;
+		int n = read(device->fd, device->buf, sizeof device->buf);
+		if (n == -1 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		if (n == -1 && errno == ECONNRESET)
+			pthread_exit(0);
+		if (n == -1)
+			gsim_error("read: %s: %s", device->path, strerror(errno));
+		if (n == 0)
+			pthread_exit(0);
+		if (device->transport == GSIM_RFC2217)
+			n = gsim_telnet(device, device->buf, n);
+		if (!n)
+			continue;
+		device->next = 0;
+		device->end = n;
+		return 1;
+	}
+}
+
+static int gsim_getc(gsim_device_t *device, int64_t deadline)
+{
+	if (device->next == device->end && !gsim_fill(device, deadline))
+		return EOF;
+	return device->buf[device->next++];
+}
+
+static void gsim_write(gsim_device_t *device, const unsigned char *buf, int size)
+{
+	if (device->transport != GSIM_RFC2217) {
+		gsim_send_raw(device, buf, size);
+		return;
+	}
+	unsigned char escaped[2 * (2 * (2 + 255 + 1) + 3)];
+	unsigned char *p = escaped;
+	int i;
+	for (i = 0; i < size; ++i) {
+		if (buf[i] == IAC)
+			*p++ = IAC;
+		*p++ = buf[i];
+	}
+	gsim_send_raw(device, escaped, p - escaped);
+}
+
+/* Reads one packet, returning its id, GSIM_TIMEOUT if none began before the
+ * deadline, or GSIM_BAD if it was corrupt or incomplete.  A bad packet is
+ * discarded along with whatever follows it until the line falls quiet. */
+static int gsim_read_packet(gsim_device_t *device, gsim_packet_t *packet, int64_t deadline)
+{
+	int c;
+	do {
+		c = gsim_getc(device, deadline);
+		if (c == EOF)
+			return GSIM_TIMEOUT;
+	} while (c != DLE);
+	int64_t frame_deadline = gsim_now() + GSIM_FRAME_TIMEOUT;
+	unsigned char raw[2 + 255 + 1];
+	int n = 0;
+	while (1) {
+		c = gsim_getc(device, frame_deadline);
+		if (c == EOF)
+			goto bad;
+		if (c == DLE) {
+			c = gsim_getc(device, frame_deadline);
+			if (c == ETX)
+				break;
+			if (c != DLE)
+				goto bad;
+		}
+		if (n == (int) sizeof raw)
+			goto bad;
+		raw[n++] = c;
+	}
+	if (n < 3 || raw[1] != n - 3)
+		goto bad;
+	unsigned char checksum = 0;
+	int i;
+	for (i = 0; i < n; ++i)
+		checksum += raw[i];
+	if (checksum)
+		goto bad;
+	packet->id = raw[0];
+	packet->size = raw[1];
+	memcpy(packet->data, raw + 2, packet->size);
+	return packet->id;
+bad:
+	while (gsim_getc(device, gsim_now() + GSIM_QUIET) != EOF)
+		;
+	return GSIM_BAD;
+}
+
+static unsigned char *gsim_stuff(unsigned char *p, int c)
+{
+	*p++ = c;
+	if (c == DLE)
+		*p++ = DLE;
+	return p;
+}
+
+static void gsim_write_packet(gsim_device_t *device, int id, const unsigned char *data, int size)
+{
+	unsigned char buf[2 * (2 + 255 + 1) + 3];
+	unsigned char *p = buf;
+	*p++ = DLE;
+	p = gsim_stuff(p, id);
+	p = gsim_stuff(p, size);
+	unsigned char checksum = id + size;
+	int i;
+	for (i = 0; i < size; ++i) {
+		p = gsim_stuff(p, data[i]);
+		checksum += data[i];
+	}
+	p = gsim_stuff(p, (unsigned char) -checksum);
+	*p++ = DLE;
+	*p++ = ETX;
+	gsim_write(device, buf, p - buf);
+}
+
+static void gsim_reply(gsim_device_t *device, int pid, int id)
+{
+	unsigned char data[2] = { id, 0 };
+	gsim_write_packet(device, pid, data, sizeof data);
+}
+
+static int gsim_same(const gsim_packet_t *a, const gsim_packet_t *b)
+{
+	return a->id == b->id && a->size == b->size && !memcmp(a->data, b->data, a->size);
+}
+
+/* Receives a packet from the host, NAKing it if it is bad and ACKing it
+ * otherwise.  Returns its id, or GSIM_TIMEOUT or GSIM_BAD. */
+static int gsim_receive(gsim_device_t *device, gsim_packet_t *packet, int64_t deadline)
+{
+	int rc = gsim_read_packet(device, packet, deadline);
+	if (rc == GSIM_BAD)
+		gsim_reply(device, Pid_Nak_Byte, 0);
+	else if (rc != GSIM_TIMEOUT && rc != Pid_Ack_Byte && rc != Pid_Nak_Byte)
+		gsim_reply(device, Pid_Ack_Byte, rc);
+	return rc;
+}
+
+/* Sends a data packet and waits for its ACK.  Packets that the host sends
+ * meanwhile are ACKed: a repeat of its last packet is a retransmission and is
+ * otherwise ignored, but a new one means that the host has moved on, so it is
+ * kept for the main loop and the send ends.  Returns zero once ACKed. */
+static int gsim_send(gsim_device_t *device, int id, const unsigned char *data, int size)
+{
+	if (device->latency)
+		gsim_sleep(device->latency);
+	++device->packets;
+	while (1) {
+		gsim_write_packet(device, id, data, size);
+		int64_t deadline = gsim_now() + device->retransmit;
+		int rc;
+		gsim_packet_t packet;
+		while ((rc = gsim_receive(device, &packet, deadline)) != GSIM_TIMEOUT) {
+			if (rc == GSIM_BAD)
+				continue;
+			if (rc == Pid_Ack_Byte) {
+				if (packet.size >= 1 && packet.data[0] == id)
+					return 0;
+				continue;
+			}
+			if (rc == Pid_Nak_Byte) {
+				++device->naks;
+				break;
+			}
+			if (gsim_same(&packet, &device->last)) {
+				++device->duplicates;
+				continue;
+			}
+			device->last = device->pending = packet;
+			device->has_pending = 1;
+			return 1;
+		}
+		++device->retransmissions;
+	}
+}
+
+static unsigned char *gsim_put16(unsigned char *p, unsigned x)
+{
+	*p++ = x;
+	*p++ = x >> 8;
+	return p;
+}
+
+static unsigned char *gsim_put32(unsigned char *p, uint32_t x)
+{
+	p = gsim_put16(p, x);
+	return gsim_put16(p, x >> 16);
+}
+
+static unsigned char *gsim_put_float(unsigned char *p, float f)
+{
+	uint32_t x;
+	memcpy(&x, &f, sizeof x);
+	return gsim_put32(p, x);
+}
+
+static unsigned char *gsim_put_protocol(unsigned char *p, int tag, int data)
+{
+	*p++ = tag;
+	return gsim_put16(p, data);
+}
+
+static void gsim_product(gsim_device_t *device)
+{
+	unsigned char data[255];
+	unsigned char *p = gsim_put16(data, device->old ? 13 : 100 + device->format);
+	p = gsim_put16(p, 270);
+	p += sprintf((char *) p, "GSIM D%d Software Version 2.70", device->format) + 1;
+	if (gsim_send(device, Pid_Product_Data, data, p - data))
+		return;
+	p = data + sprintf((char *) data, "VERBMAP GSIM %d", device->index) + 1;
+	if (gsim_send(device, Pid_Ext_Product_Data, data, p - data) || device->old)
+		return;
+	p = gsim_put_protocol(data, 'P', 0);
+	p = gsim_put_protocol(p, 'L', 1);
+	p = gsim_put_protocol(p, 'A', 10);
+	switch (device->format) {
+		case 300:
+			p = gsim_put_protocol(p, 'A', 300);
+			break;
+		case 301:
+		case 302:
+			p = gsim_put_protocol(p, 'A', 301);
+			p = gsim_put_protocol(p, 'D', 310);
+			break;
+		default:
+			p = gsim_put_protocol(p, 'A', 302);
+			p = gsim_put_protocol(p, 'D', 311);
+			break;
+	}
+	p = gsim_put_protocol(p, 'D', device->format);
+	gsim_send(device, Pid_Protocol_Array, data, p - data);
+}
+
+/* The track log holds two flights two hours apart, each a straight line at
+ * about 13km/h with a point every ten seconds, climbing and sinking 800m.
+ * Every hundredth point repeats the one before, as some units log a fix
+ * twice, so that identical consecutive packets are sent. */
+static int gsim_point(const gsim_device_t *device, int i, unsigned char *data)
+{
+	int half = device->npoints / 2;
+	if (i % 100 == 99 && i - 1 != half)
+		--i;
+	uint32_t time = GSIM_START + 10 * i + (i >= half ? 7200 : 0);
+	double lat = 46.0 + 0.1 * device->index + 0.0003 * (i + 1);
+	double lon = 7.0 + 0.0002 * (i + 1);
+	float alt = 1000.0 + 800.0 * sin(i / 50.0) + i % 7;
+	unsigned char *p = gsim_put32(data, (int32_t) (lat * 2147483648.0 / 180.0));
+	p = gsim_put32(p, (int32_t) (lon * 2147483648.0 / 180.0));
+	p = gsim_put32(p, time);
+	if (device->format != 300)
+		p = gsim_put_float(p, alt);
+	switch (device->format) {
+		case 302:
+			p = gsim_put_float(p, 1.0e25);
+			p = gsim_put_float(p, 20.0);
+			/* fall through */
+		case 300:
+		case 301:
+			if (device->format == 301)
+				p = gsim_put_float(p, 1.0e25);
+			*p++ = i == 0 || i == half;
+			break;
+		case 303:
+			*p++ = 0;
+			break;
+		case 304:
+			p = gsim_put_float(p, 36.0 * i);
+			*p++ = 0;
+			*p++ = 0;
+			*p++ = 0;
+			break;
+	}
+	return p - data;
+}
+
+static void gsim_transfer_trk(gsim_device_t *device)
+{
+	unsigned char data[255];
+	int header = device->format != 300;
+	if (device->stall)
+		gsim_sleep(device->stall);
+	gsim_put16(data, device->npoints + header);
+	if (gsim_send(device, Pid_Records, data, 2))
+		return;
+	if (header) {
+		int size;
+		if (device->format == 303 || device->format == 304) {
+			size = gsim_put16(data, 0) - data;
+		} else {
+			data[0] = 1;
+			data[1] = 255;
+			size = 2 + sprintf((char *) data + 2, "ACTIVE LOG") + 1;
+		}
+		if (gsim_send(device, Pid_Trk_Hdr, data, size))
+			return;
+	}
+	int i;
+	for (i = 0; i < device->npoints; ++i)
+		if (gsim_send(device, Pid_Trk_Data, data, gsim_point(device, i, data)))
+			return;
+	gsim_put16(data, Cmnd_Transfer_Trk);
+	gsim_send(device, Pid_Xfer_Cmplt, data, 2);
+}
+
+static void gsim_accept(gsim_device_t *device)
+{
+	do
+		device->fd = accept(device->listener, 0, 0);
+	while (device->fd == -1 && errno == EINTR);
+	if (device->fd == -1)
+		gsim_error("accept: %s: %s", device->path, strerror(errno));
+	close(device->listener);
+	int one = 1;
+	if (setsockopt(device->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one) == -1)
+		gsim_error("setsockopt: %s", strerror(errno));
+	if (device->transport == GSIM_RFC2217) {
+		static const unsigned char offers[] = { IAC, WILL, TELOPT_ECHO, IAC, DO, TELOPT_TTYPE };
+		gsim_send_raw(device, offers, sizeof offers);
+	}
+}
+
+static void *gsim_run(void *data)
+{
+	gsim_device_t *device = data;
+	if (device->transport != GSIM_PTY)
+		gsim_accept(device);
+	while (1) {
+		gsim_packet_t packet;
+		if (device->has_pending) {
+			packet = device->pending;
+			device->has_pending = 0;
+		} else {
+			int rc = gsim_receive(device, &packet, -1);
+			if (rc == GSIM_BAD || rc == Pid_Ack_Byte || rc == Pid_Nak_Byte)
+				continue;
+			device->last = packet;
+		}
+		if (packet.id == Pid_Product_Rqst) {
+			gsim_product(device);
+		} else if (packet.id == Pid_Command_Data && packet.size >= 2) {
+			int command = packet.data[0] | packet.data[1] << 8;
+			if (command == Cmnd_Transfer_Trk)
+				gsim_transfer_trk(device);
+			else if (command == Cmnd_Turn_Off_Pwr)
+				return 0;
+		}
+	}
+}
+
+static void gsim_open(gsim_device_t *device)
+{
+	device->fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (device->fd == -1)
+		gsim_error("posix_openpt: %s", strerror(errno));
+	if (grantpt(device->fd) == -1 || unlockpt(device->fd) == -1)
+		gsim_error("grantpt: %s", strerror(errno));
+	device->path = strdup(ptsname(device->fd));
+	if (!device->path)
+		gsim_error("strdup: %s", strerror(errno));
+	/* Keeping the slave open stops reads on the master failing while the
+	 * command has none open. */
+	device->slave = open(device->path, O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (device->slave == -1)
+		gsim_error("open: %s: %s", device->path, strerror(errno));
+	struct termios termios;
+	if (tcgetattr(device->slave, &termios) == -1)
+		gsim_error("tcgetattr: %s: %s", device->path, strerror(errno));
+	cfmakeraw(&termios);
+	if (tcsetattr(device->slave, TCSANOW, &termios) == -1)
+		gsim_error("tcsetattr: %s: %s", device->path, strerror(errno));
+}
+
+static void gsim_listen(gsim_device_t *device)
+{
+	device->listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (device->listener == -1)
+		gsim_error("socket: %s", strerror(errno));
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof addr);
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addrlen = sizeof addr;
+	if (bind(device->listener, (struct sockaddr *) &addr, sizeof addr) == -1 || listen(device->listener, 1) == -1 || getsockname(device->listener, (struct sockaddr *) &addr, &addrlen) == -1)
+		gsim_error("listen: %s", strerror(errno));
+	if (asprintf(&device->path, "%s:127.0.0.1:%d", device->transport == GSIM_TCP ? "tcp" : "rfc2217", ntohs(addr.sin_port)) == -1)
+		gsim_error("asprintf: %s", strerror(errno));
+}
+
+static void usage(void)
+{
+	printf("%s - simulate Garmin GPSs for testing garmini\n"
+			"Usage: %s [options] [--] COMMAND [ARG...]\n"
+			"Options:\n"
+			"\t-h\t\tshow some help\n"
+			"\t-c COUNT\tsimulate COUNT devices (default 1)\n"
+			"\t-p FORMAT\ttrack point format, 300 to 304, or mix (default 301)\n"
+			"\t-n POINTS\ttrack points per device (default 1000)\n"
+			"\t-l USEC\t\tdelay before each packet that a device sends\n"
+			"\t-s USEC\t\tfurther delay before sending the track log\n"
+			"\t-T USEC\t\tretransmission timeout (default 1000000)\n"
+			"\t-t\t\tserve the devices over raw TCP instead of pseudo-terminals\n"
+			"\t-R\t\tserve the devices over RFC 2217 instead of pseudo-terminals\n"
+			"\t-o\t\tsimulate old devices, product 13 with format 300 and no\n"
+			"\t\t\tProtocol_Array\n"
+			"\t-v\t\treport what each device sent on exit\n"
+			"With -p mix, device i uses format D30(i mod 5), between POINTS/2 and\n"
+			"POINTS points and a delay of up to USEC.\n",
+		program_name, program_name);
+}
+
+static long gsim_number(const char *s)
+{
+	char *endptr;
+	long n = strtol(s, &endptr, 10);
+	if (endptr == s || *endptr != '\0' || n < 0)
+		gsim_error("invalid argument '%s'", s);
+	return n;
+}
+
+int main(int argc, char *argv[])
+{
+	int count = 1;
+	int format = 301;
+	int npoints = 1000;
+	int64_t latency = 0;
+	int64_t stall = 0;
+	int64_t retransmit = 1000 * 1000;
+	int transport = GSIM_PTY;
+	int verbose = 0;
+	int old = 0;
+	int c;
+	while ((c = getopt(argc, argv, "+hc:p:n:l:s:T:tRov")) != -1) {
+		switch (c) {
+			case 'c':
+				count = gsim_number(optarg);
+				break;
+			case 'h':
+				usage();
+				exit(EXIT_SUCCESS);
+			case 'l':
+				latency = gsim_number(optarg);
+				break;
+			case 'n':
+				npoints = gsim_number(optarg);
+				break;
+			case 'p':
+				format = strcmp(optarg, "mix") == 0 ? GSIM_MIX : gsim_number(optarg);
+				if (format != GSIM_MIX && (format < 300 || 304 < format))
+					gsim_error("invalid format '%s'", optarg);
+				break;
+			case 's':
+				stall = gsim_number(optarg);
+				break;
+			case 'o':
+				old = 1;
+				break;
+			case 'R':
+				transport = GSIM_RFC2217;
+				break;
+			case 'T':
+				retransmit = gsim_number(optarg);
+				break;
+			case 't':
+				transport = GSIM_TCP;
+				break;
+			case 'v':
+				verbose = 1;
+				break;
+			default:
+				exit(EXIT_FAILURE);
+		}
+	}
+	if (optind == argc || count < 1 || npoints < 2 || 65535 < npoints)
+		gsim_error("invalid arguments, try -h");
+
+	gsim_device_t *devices = calloc(count, sizeof(gsim_device_t));
+	char **args = calloc(argc - optind + 2 * count + 1, sizeof(char *));
+	if (!devices || !args)
+		gsim_error("calloc: %s", strerror(errno));
+	int nargs = 0;
+	args[nargs++] = argv[optind];
+	int i;
+	for (i = 0; i < count; ++i) {
+		gsim_device_t *device = devices + i;
+		device->index = i;
+		device->format = old ? 300 : format == GSIM_MIX ? 300 + i % 5 : format;
+		device->old = old;
+		device->npoints = format == GSIM_MIX ? npoints / 2 + (int) ((long) i * 7919 % (npoints / 2 + 1)) : npoints;
+		device->latency = format == GSIM_MIX ? latency * (i % 4) / 3 : latency;
+		device->stall = stall;
+		device->retransmit = retransmit;
+		device->last.id = -1;
+		device->transport = transport;
+		if (transport == GSIM_PTY)
+			gsim_open(device);
+		else
+			gsim_listen(device);
+		int rc = pthread_create(&device->thread, 0, gsim_run, device);
+		if (rc)
+			gsim_error("pthread_create: %s", strerror(rc));
+		args[nargs++] = "-d";
+		args[nargs++] = device->path;
+	}
+	for (i = optind + 1; i < argc; ++i)
+		args[nargs++] = argv[i];
+	args[nargs] = 0;
+
+	pid_t pid = fork();
+	if (pid == -1)
+		gsim_error("fork: %s", strerror(errno));
+	if (pid == 0) {
+		execvp(args[0], args);
+		fprintf(stderr, "%s: %s: %s\n", program_name, args[0], strerror(errno));
+		_exit(127);
+	}
+	int status;
+	while (waitpid(pid, &status, 0) == -1)
+		if (errno != EINTR)
+			gsim_error("waitpid: %s", strerror(errno));
+	if (verbose) {
+		for (i = 0; i < count; ++i) {
+			gsim_device_t *device = devices + i;
+			fprintf(stderr, "%s: %s: D%d, %d points, %d packets, %d retransmissions, %d NAKs, %d duplicates\n", program_name, device->path, device->format, device->npoints, device->packets, device->retransmissions, device->naks, device->duplicates);
+		}
+	}
+	if (status == 0 && transport == GSIM_RFC2217) {
+		for (i = 0; i < count; ++i) {
+			gsim_device_t *device = devices + i;
+			if (device->baudrate != 9600 || device->datasize != 8 || device->parity != 1 || device->stopsize != 1)
+				gsim_error("%s: port set to %ld baud, data size %d, parity %d, stop size %d, expected 9600 8N1", device->path, device->baudrate, device->datasize, device->parity, device->stopsize);
+			if (device->refusals != 2)
+				gsim_error("%s: %d of 2 offered options refused", device->path, device->refusals);
+		}
+	}
+	exit(WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+}
@@ -0,0 +1,41 @@
+#!/bin/sh
+#
+# Downloads from DEVICES simulated GPSs at once, a mix of the D300 to D304
+# track point formats, and checks that every flight arrives.  Fails if
+# fewer than MIN_RATE records/s are downloaded or if the maximum resident
+# set size exceeds MAX_RSS kB, when these are set.
+#
+# Usage: test/loadtest.sh [DEVICES [POINTS [LATENCY]]]
+
+DEVICES=${1:-${DEVICES:-64}}
+POINTS=${2:-${POINTS:-2000}}
+LATENCY=${3:-${LATENCY:-1000}}
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -Rf "$dir"' EXIT
+
+echo "loadtest: $DEVICES devices, $POINTS points, ${LATENCY}us latency"
+if ! test/gsim -c "$DEVICES" -p mix -n "$POINTS" -l "$LATENCY" -- \
+		./garmini -q -X -D "$dir" download 2> "$dir/stats"; then
+	cat "$dir/stats"
+	echo "loadtest: FAIL: garmini failed"
+	exit 1
+fi
+grep -E 'sessions?,|completed in|cpu user' "$dir/stats"
+
+flights=$(find "$dir" -name '*.IGC' | wc -l)
+if [ "$flights" -ne $((2 * DEVICES)) ]; then
+	echo "loadtest: FAIL: $flights flights, expected $((2 * DEVICES))"
+	exit 1
+fi
+rate=$(sed -n 's/.* \([0-9]*\) records\/s$/\1/p' "$dir/stats")
+if [ -n "$MIN_RATE" ] && [ "${rate:-0}" -lt "$MIN_RATE" ]; then
+	echo "loadtest: FAIL: $rate records/s, expected at least $MIN_RATE"
+	exit 1
+fi
+rss=$(sed -n 's/.*max rss \([0-9]*\)kB.*/\1/p' "$dir/stats")
+if [ -n "$MAX_RSS" ] && [ "${rss:-0}" -gt "$MAX_RSS" ]; then
+	echo "loadtest: FAIL: max rss ${rss}kB, expected at most ${MAX_RSS}kB"
+	exit 1
+fi
+echo "loadtest: PASS: $flights flights"
@@ -0,0 +1,120 @@
+/*
+
+   garmini - download track log from Garmin GPSs
+   Copyright (C) 2007  Tom Payne
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../garmini.h"
+#include "../sha256.h"
+
+/* Known answers for SHA-256 from FIPS 180-2 and for HMAC-SHA-256 from RFC
+ * 4231.  Every message is hashed both in one piece and a byte at a time, to
+ * exercise the buffering across blocks. */
+
+#define SHA256TEST_COUNT(vectors) ((int) (sizeof (vectors) / sizeof (vectors)[0]))
+
+const char *program_name = "sha256test";
+
+static const struct {
+	const char *message;
+	int repeat;
+	const char *digest;
+} sha256test_vectors[] = {
+	{ "abc", 1, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" },
+	{ "", 1, "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855" },
+	{ "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1, "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1" },
+	{ "a", 1000000, "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0" }
+};
+
+static const struct {
+	unsigned char key_byte;
+	int key_size;
+	const char *key;
+	const char *message;
+	const char *mac;
+} sha256test_hmac_vectors[] = {
+	{ 0x0b, 20, 0, "Hi There", "b0344c61d8db38535ca8afceaf0bf12b881dc200c9833da726e9376c2e32cff7" },
+	{ 0, 4, "Jefe", "what do ya want for nothing?", "5bdcc146bf60754e6a042426089575c75a003f089d2739839dec58b964ec3843" },
+	{ 0xaa, 131, 0, "Test Using Larger Than Block-Size Key - Hash Key First", "60e431591ee0b67f0d8a26aacbf5b77f8e0bc6213728c5140546040f0ee37f54" }
+};
+
+static void sha256test_check(const char *name, const unsigned char *digest, const char *expected)
+{
+	char hex[2 * SHA256_DIGEST_SIZE + 1];
+	int i;
+	for (i = 0; i < SHA256_DIGEST_SIZE; ++i)
+		sprintf(hex + 2 * i, "%02x", digest[i]);
+	if (strcmp(hex, expected))
+		error("%s is %s, expected %s", name, hex, expected);
+}
+
+int main(void)
+{
+	unsigned char digest[SHA256_DIGEST_SIZE];
+	int i, bytewise;
+	for (i = 0; i < SHA256TEST_COUNT(sha256test_vectors); ++i) {
+		const char *message = sha256test_vectors[i].message;
+		size_t size = strlen(message);
+		for (bytewise = 0; bytewise < 2; ++bytewise) {
+			sha256_t sha256;
+			sha256_init(&sha256);
+			int r;
+			for (r = 0; r < sha256test_vectors[i].repeat; ++r) {
+				size_t j;
+				if (bytewise)
+					for (j = 0; j < size; ++j)
+						sha256_update(&sha256, message + j, 1);
+				else
+					sha256_update(&sha256, message, size);
+			}
+			sha256_final(&sha256, digest);
+			char name[64];
+			snprintf(name, sizeof name, "SHA-256 vector %d%s", i + 1, bytewise ? " bytewise" : "");
+			sha256test_check(name, digest, sha256test_vectors[i].digest);
+		}
+	}
+	for (i = 0; i < SHA256TEST_COUNT(sha256test_hmac_vectors); ++i) {
+		unsigned char key[256];
+		int key_size = sha256test_hmac_vectors[i].key_size;
+		if (sha256test_hmac_vectors[i].key)
+			memcpy(key, sha256test_hmac_vectors[i].key, key_size);
+		else
+			memset(key, sha256test_hmac_vectors[i].key_byte, key_size);
+		const char *message = sha256test_hmac_vectors[i].message;
+		size_t size = strlen(message);
+		for (bytewise = 0; bytewise < 2; ++bytewise) {
+			hmac_sha256_t hmac;
+			hmac_sha256_init(&hmac, key, key_size);
+			size_t j;
+			if (bytewise)
+				for (j = 0; j < size; ++j)
+					hmac_sha256_update(&hmac, message + j, 1);
+			else
+				hmac_sha256_update(&hmac, message, size);
+			hmac_sha256_final(&hmac, digest);
+			char name[64];
+			snprintf(name, sizeof name, "HMAC-SHA-256 vector %d%s", i + 1, bytewise ? " bytewise" : "");
+			sha256test_check(name, digest, sha256test_hmac_vectors[i].mac);
+		}
+	}
+	printf("%s: PASS: %d SHA-256 and %d HMAC-SHA-256 vectors\n", program_name, SHA256TEST_COUNT(sha256test_vectors), SHA256TEST_COUNT(sha256test_hmac_vectors));
+	return 0;
+}
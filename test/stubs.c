@@ -0,0 +1,69 @@
+/*
+
+   garmini - download track log from Garmin GPSs
+   Copyright (C) 2007  Tom Payne
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../garmini.h"
+
+/* What garmini.c provides to the other modules, for test programs that link
+ * them without it.  Each program sets program_name itself. */
+
+void error(const char *message, ...)
+{
+	fprintf(stderr, "%s: ", program_name);
+	va_list ap;
+	va_start(ap, message);
+	vfprintf(stderr, message, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	exit(EXIT_FAILURE);
+}
+
+void warning(const char *message, ...)
+{
+	fprintf(stderr, "%s: ", program_name);
+	va_list ap;
+	va_start(ap, message);
+	vfprintf(stderr, message, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+}
+
+void die(const char *file, int line, const char *function, const char *message, int _errno)
+{
+	error("%s:%d: %s: %s: %s", file, line, function, message, strerror(_errno));
+}
+
+void *alloc(int size)
+{
+	void *p = calloc(1, size);
+	if (!p)
+		DIE("calloc", errno);
+	return p;
+}
+
+int format_char(char *buf, int c)
+{
+	return sprintf(buf, "\\x%02x", c & 0xff);
+}
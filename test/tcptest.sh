@@ -0,0 +1,38 @@
+#!/bin/sh
+#
+# Downloads from simulated device servers over raw TCP and RFC 2217 and
+# checks that both downloads match one over pseudo-terminals.  Each session
+# writes its own files, named by its serial number, so that they can be
+# compared one by one whatever order the sessions finish in.  In RFC 2217
+# mode test/gsim also checks the port settings and option refusals.
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -Rf "$dir"' EXIT
+
+for mode in pty -t -R; do
+	option=$mode
+	[ $mode = pty ] && option=
+	mkdir "$dir/$mode"
+	if ! test/gsim $option -c 5 -p mix -n 500 -- ./garmini -q -s 1 -D "$dir/$mode" download; then
+		echo "tcptest: FAIL: $mode"
+		exit 1
+	fi
+done
+files=$(cd "$dir/pty" && ls)
+if [ $(echo "$files" | wc -l) -ne 10 ]; then
+	echo "tcptest: FAIL: $(echo "$files" | wc -l) files, expected 10"
+	exit 1
+fi
+for mode in -t -R; do
+	if [ "$(cd "$dir/$mode" && ls)" != "$files" ]; then
+		echo "tcptest: FAIL: $mode downloaded other files"
+		exit 1
+	fi
+	for file in $files; do
+		if ! cmp -s "$dir/pty/$file" "$dir/$mode/$file"; then
+			echo "tcptest: FAIL: $mode download of $file differs"
+			exit 1
+		fi
+	done
+done
+echo "tcptest: PASS"
@@ -0,0 +1,203 @@
+/*
+
+   garmini - download track log from Garmin GPSs
+   Copyright (C) 2007  Tom Payne
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../cpu.h"
+#include "../garmini.h"
+#include "../track.h"
+
+/* Checks the track index against brute force on random tracks: points
+ * without a position or a valid altitude, runs of equal times, gaps, and
+ * ranges of every length from empty to the whole track, located both by
+ * position and by time.  Each track is indexed once with its own altitudes and
+ * once with a separate altitude array, as for analysis smoothing.  The
+ * smoother is checked against a direct least squares fit of each window, both
+ * into an array and in place, and must leave parabolas as they are. */
+
+#define TRACKTEST_TRACKS 20
+#define TRACKTEST_POINTS 1000
+#define TRACKTEST_RANGES 2000
+#define TRACKTEST_HALF 8
+#define TRACKTEST_GAP 60
+
+const char *program_name = "tracktest";
+
+static int tracktest_has_posn(const garmin_trk_point_t *trk_point)
+{
+	return trk_point->posn.lat != 0x7fffffff || trk_point->posn.lon != 0x7fffffff;
+}
+
+static int tracktest_has_alt(const garmin_trk_point_t *trk_point)
+{
+	return trk_point->valid && trk_point->alt != 1.0e25f;
+}
+
+static void tracktest_random(garmin_trk_point_t *trk_points, float *alt, int n)
+{
+	uint32_t time = 600000000;
+	double lat = 46.0, lon = 7.0, a = 1000.0;
+	int i;
+	for (i = 0; i < n; ++i) {
+		time += rand() % 50 ? rand() % 4 : 61 + rand() % 100;
+		lat += (rand() % 201 - 100) * 1e-5;
+		lon += (rand() % 201 - 100) * 1e-5;
+		a += (rand() % 201 - 100) * 0.1;
+		trk_points[i].time = time;
+		trk_points[i].valid = rand() % 10 != 0;
+		trk_points[i].alt = rand() % 20 ? a : 1.0e25f;
+		if (rand() % 10) {
+			trk_points[i].posn.lat = lat * 2147483648.0 / 180.0;
+			trk_points[i].posn.lon = lon * 2147483648.0 / 180.0;
+		} else {
+			trk_points[i].posn.lat = trk_points[i].posn.lon = 0x7fffffff;
+		}
+		alt[i] = a + (rand() % 21 - 10);
+	}
+}
+
+static void tracktest_check(const garmin_trk_point_t *trk_points, const float *alt, int n)
+{
+	garmini_track_index_t *index = garmini_track_index_new(trk_points, trk_points + n, alt);
+	int r;
+	for (r = 0; r < TRACKTEST_RANGES; ++r) {
+		int i = rand() % (n + 1);
+		int j = i + rand() % (n + 1 - i);
+		float min_alt = FLT_MAX, max_alt = -FLT_MAX;
+		double distance = 0.0, gain = 0.0;
+		int k;
+		for (k = i; k < j; ++k) {
+			const garmin_trk_point_t *trk_point = trk_points + k;
+			float a = alt ? alt[k] : trk_point->alt;
+			if (tracktest_has_alt(trk_point)) {
+				if (a < min_alt)
+					min_alt = a;
+				if (a > max_alt)
+					max_alt = a;
+			}
+			if (k == i)
+				continue;
+			if (tracktest_has_posn(trk_point - 1) && tracktest_has_posn(trk_point))
+				distance += garmini_distance_fai(trk_point - 1, trk_point);
+			float b = alt ? alt[k - 1] : trk_point[-1].alt;
+			if (tracktest_has_alt(trk_point - 1) && tracktest_has_alt(trk_point) && a > b)
+				gain += a - b;
+		}
+		if (garmini_track_index_min_alt(index, i, j) != min_alt || garmini_track_index_max_alt(index, i, j) != max_alt)
+			error("altitudes of [%d, %d) differ", i, j);
+		if (fabs(garmini_track_index_distance(index, i, j) - distance) > 1e-6 * (1.0 + distance))
+			error("distance of [%d, %d) is %f, expected %f", i, j, garmini_track_index_distance(index, i, j), distance);
+		if (fabs(garmini_track_index_gain(index, i, j) - gain) > 1e-6 * (1.0 + gain))
+			error("gain of [%d, %d) is %f, expected %f", i, j, garmini_track_index_gain(index, i, j), gain);
+		if (i == j)
+			continue;
+		time_t time1 = trk_points[i].time, time2 = trk_points[j - 1].time;
+		int i1, j1;
+		int count = garmini_track_index_range(index, time1, time2, &i1, &j1);
+		for (k = i1; k < j1; ++k)
+			if (trk_points[k].time < time1 || trk_points[k].time > time2)
+				error("point %d outside [%ld, %ld]", k, (long) time1, (long) time2);
+		if (count != j1 - i1 || i1 > i || j1 < j || (i1 > 0 && trk_points[i1 - 1].time >= time1) || (j1 < n && trk_points[j1].time <= time2))
+			error("range [%ld, %ld] is [%d, %d), expected to cover [%d, %d)", (long) time1, (long) time2, i1, j1, i, j);
+		garmini_summary_t summary;
+		garmini_summary_range(&summary, index, i, j);
+		if (summary.npoints != j - i || summary.min_alt != min_alt || summary.max_alt != max_alt || summary.distance != garmini_track_index_distance(index, i, j))
+			error("summary of [%d, %d) differs", i, j);
+	}
+	garmini_track_index_delete(index);
+}
+
+static int tracktest_linked(const garmin_trk_point_t *trk_point)
+{
+	return tracktest_has_alt(trk_point - 1) && tracktest_has_alt(trk_point) && trk_point->time >= trk_point[-1].time && trk_point->time - trk_point[-1].time <= TRACKTEST_GAP;
+}
+
+/* The value at point i of the least squares parabola through the widest
+ * window of up to TRACKTEST_HALF linked points either side. */
+static double tracktest_smoothed(const garmin_trk_point_t *trk_points, int n, int i)
+{
+	if (!tracktest_has_alt(trk_points + i))
+		return trk_points[i].alt;
+	int h = 0;
+	while (h < TRACKTEST_HALF && i - h - 1 >= 0 && i + h + 1 < n && tracktest_linked(trk_points + i - h) && tracktest_linked(trk_points + i + h + 1))
+		++h;
+	double s0 = 0.0, s2 = 0.0, s4 = 0.0, y0 = 0.0, y2 = 0.0;
+	int k;
+	for (k = -h; k <= h; ++k) {
+		s0 += 1.0;
+		s2 += k * k;
+		s4 += (double) k * k * k * k;
+		y0 += trk_points[i + k].alt;
+		y2 += k * k * trk_points[i + k].alt;
+	}
+	return h ? (s4 * y0 - s2 * y2) / (s0 * s4 - s2 * s2) : trk_points[i].alt;
+}
+
+static void tracktest_check_smooth(garmin_trk_point_t *trk_points, int n, int parabolas)
+{
+	garmin_arena_t *arena = garmin_arena_new();
+	garmini_track_t *track = garmini_track_new(arena, n ? n : 1);
+	int i;
+	for (i = 0; i < n; ++i) {
+		if (parabolas)
+			trk_points[i].alt = 1000.0 + 0.5 * i - 0.0005 * i * i;
+		garmini_track_push(track, trk_points + i);
+	}
+	float *scalar = garmin_arena_alloc(arena, (n ? n : 1) * sizeof(float));
+	float *alt = garmin_arena_alloc(arena, (n ? n : 1) * sizeof(float));
+	garmini_cpu_force(GARMINI_CPU_SCALAR);
+	garmini_track_smoothed(track, scalar);
+	int level;
+	for (level = GARMINI_CPU_SCALAR; level <= garmini_cpu_detect(); ++level) {
+		garmini_cpu_force(level);
+		garmini_track_smoothed(track, alt);
+		if (memcmp(alt, scalar, n * sizeof(float)))
+			error("%s smoothing differs from scalar", garmini_cpu_name(level));
+	}
+	garmini_track_smooth(track);
+	for (i = 0; i < n; ++i) {
+		double expected = parabolas ? trk_points[i].alt : tracktest_smoothed(trk_points, n, i);
+		if (fabs(alt[i] - expected) > 1e-2 || track->begin[i].alt != alt[i])
+			error("smoothed altitude %d is %f and %f, expected %f", i, alt[i], track->begin[i].alt, expected);
+	}
+	garmin_arena_delete(arena);
+}
+
+int main(void)
+{
+	static garmin_trk_point_t trk_points[TRACKTEST_POINTS];
+	static float alt[TRACKTEST_POINTS];
+	srand(1);
+	int t;
+	for (t = 0; t < TRACKTEST_TRACKS; ++t) {
+		int n = t == 0 ? 0 : t == 1 ? 1 : 1 + rand() % TRACKTEST_POINTS;
+		tracktest_random(trk_points, alt, n);
+		tracktest_check(trk_points, 0, n);
+		tracktest_check(trk_points, alt, n);
+		tracktest_check_smooth(trk_points, n, 0);
+		tracktest_check_smooth(trk_points, n, 1);
+	}
+	printf("%s: PASS: %d tracks, %d ranges each\n", program_name, TRACKTEST_TRACKS, TRACKTEST_RANGES);
+	return 0;
+}
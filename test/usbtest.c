@@ -0,0 +1,290 @@
+/*
+
+   garmini - download track log from Garmin GPSs
+   Copyright (C) 2007  Tom Payne
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <linux/usbdevice_fs.h>
+
+#include "../garmin.h"
+#include "../garmini.h"
+#include "../usb.h"
+
+/* Drives the USB transport through a mock device.  The device node is a
+ * regular file holding a Forerunner's descriptors, and, linked with
+ * -Wl,--wrap=ioctl, the usbfs requests on it are answered here: the mock
+ * starts a session, answers a product request with an Ext_Product_Data too
+ * long for a serial packet, and sends a D304 track log of USBTEST_POINTS
+ * points on the bulk endpoint. */
+
+#define USBTEST_POINTS 500
+#define USBTEST_QUEUE_SIZE 1024
+#define USBTEST_BULK_IN 0x81
+#define USBTEST_BULK_OUT 0x02
+#define USBTEST_INTERRUPT_IN 0x83
+
+enum {
+	Pid_Command_Data     =  10,
+	Pid_Xfer_Cmplt       =  12,
+	Pid_Records          =  27,
+	Pid_Trk_Data         =  34,
+	Pid_Trk_Hdr          =  99,
+	Pid_Ext_Product_Data = 248,
+	Pid_Protocol_Array   = 253,
+	Pid_Product_Rqst     = 254,
+	Pid_Product_Data     = 255
+};
+
+enum {
+	Tag_Data_Prot_Id = 'D'
+};
+
+enum {
+	Cmnd_Transfer_Trk = 6
+};
+
+typedef struct {
+	int size;
+	unsigned char data[12 + 512];
+} usbtest_transfer_t;
+
+typedef struct {
+	int head;
+	int tail;
+	usbtest_transfer_t transfers[USBTEST_QUEUE_SIZE];
+} usbtest_queue_t;
+
+static const unsigned char usbtest_descriptors[] = {
+	/* device: USB 2.0, vendor 0x091e, product 0x0003 */
+	18, 1, 0x00, 0x02, 0xff, 0xff, 0xff, 64, 0x1e, 0x09, 0x03, 0x00, 0x01, 0x00, 0, 0, 0, 1,
+	/* configuration */
+	9, 2, 9 + 9 + 3 * 7, 0, 1, 1, 0, 0xc0, 0,
+	/* interface 0 */
+	9, 4, 0, 0, 3, 0xff, 0xff, 0xff, 0,
+	/* bulk in, bulk out and interrupt in */
+	7, 5, USBTEST_BULK_IN, 2, 64, 0, 0,
+	7, 5, USBTEST_BULK_OUT, 2, 64, 0, 0,
+	7, 5, USBTEST_INTERRUPT_IN, 3, 64, 0, 1
+};
+
+static usbtest_queue_t usbtest_interrupt;
+static usbtest_queue_t usbtest_bulk;
+static struct stat usbtest_node;
+static char usbtest_path[] = "/tmp/usbtest.XXXXXX";
+static int usbtest_started = 0;
+
+const char *program_name = "usbtest";
+
+static void usbtest_push(usbtest_queue_t *queue, int type, int id, const void *data, int size)
+{
+	if (queue->tail - queue->head == USBTEST_QUEUE_SIZE)
+		error("mock queue full");
+	usbtest_transfer_t *transfer = queue->transfers + queue->tail++ % USBTEST_QUEUE_SIZE;
+	memset(transfer->data, 0, 12);
+	transfer->data[0] = type;
+	transfer->data[4] = id;
+	transfer->data[5] = id >> 8;
+	transfer->data[8] = size;
+	transfer->data[9] = size >> 8;
+	memcpy(transfer->data + 12, data, size);
+	transfer->size = 12 + size;
+}
+
+static void usbtest_send(int id, const void *data, int size)
+{
+	if (usbtest_bulk.tail == usbtest_bulk.head)
+		usbtest_push(&usbtest_interrupt, 0, 2, 0, 0);
+	usbtest_push(&usbtest_bulk, 20, id, data, size);
+}
+
+static int usbtest_point(int i, unsigned char *data)
+{
+	int32_t lat = 0x20c49ba5 + 1000 * i;
+	int32_t lon = 0x04fa58f7 + 700 * i;
+	uint32_t time = 600000000 + 10 * i;
+	float alt = 1000.0 + i;
+	float distance = 36.0 * i;
+	memcpy(data, &lat, 4);
+	memcpy(data + 4, &lon, 4);
+	memcpy(data + 8, &time, 4);
+	memcpy(data + 12, &alt, 4);
+	memcpy(data + 16, &distance, 4);
+	data[20] = i % 200;
+	data[21] = 0xff;
+	data[22] = 0;
+	return 23;
+}
+
+static void usbtest_receive(const unsigned char *buf, int size)
+{
+	if (size == 0)
+		return;
+	if (size < 12 || size != 12 + (buf[8] | buf[9] << 8))
+		error("mock received a bad packet");
+	int type = buf[0];
+	int id = buf[4] | buf[5] << 8;
+	if (type == 0 && id == 5) {
+		static const unsigned char unit_id[4] = { 0x78, 0x56, 0x34, 0x12 };
+		usbtest_push(&usbtest_interrupt, 0, 6, unit_id, sizeof unit_id);
+		usbtest_started = 1;
+		return;
+	}
+	if (!usbtest_started || type != 20)
+		error("mock received packet %d before the session started", id);
+	unsigned char data[512];
+	if (id == Pid_Product_Rqst) {
+		data[0] = 484 & 0xff;
+		data[1] = 484 >> 8;
+		data[2] = 280 & 0xff;
+		data[3] = 280 >> 8;
+		int n = 4 + sprintf((char *) data + 4, "Forerunner305 Software Version 2.80") + 1;
+		usbtest_send(Pid_Product_Data, data, n);
+		memset(data, 'x', 300);
+		data[299] = '\0';
+		usbtest_send(Pid_Ext_Product_Data, data, 300);
+		static const unsigned char protocols[] = { 'P', 0, 0, 'L', 1, 0, 'A', 10, 0, 'A', 0x2e, 0x01, 'D', 0x37, 0x01, 'D', 0x30, 0x01 };
+		usbtest_send(Pid_Protocol_Array, protocols, sizeof protocols);
+	} else if (id == Pid_Command_Data && size == 14 && buf[12] == Cmnd_Transfer_Trk) {
+		data[0] = (USBTEST_POINTS + 1) & 0xff;
+		data[1] = (USBTEST_POINTS + 1) >> 8;
+		usbtest_send(Pid_Records, data, 2);
+		data[0] = data[1] = 0;
+		usbtest_send(Pid_Trk_Hdr, data, 2);
+		int i;
+		for (i = 0; i < USBTEST_POINTS; ++i)
+			usbtest_send(Pid_Trk_Data, data, usbtest_point(i, data));
+		data[0] = Cmnd_Transfer_Trk;
+		data[1] = 0;
+		usbtest_send(Pid_Xfer_Cmplt, data, 2);
+	} else {
+		error("mock received unexpected packet %d", id);
+	}
+}
+
+static int usbtest_transfer(struct usbdevfs_bulktransfer *bulk)
+{
+	usbtest_queue_t *queue;
+	if (bulk->ep == USBTEST_BULK_OUT) {
+		usbtest_receive(bulk->data, bulk->len);
+		return bulk->len;
+	} else if (bulk->ep == USBTEST_INTERRUPT_IN) {
+		queue = &usbtest_interrupt;
+		if (queue->head == queue->tail) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+	} else if (bulk->ep == USBTEST_BULK_IN) {
+		queue = &usbtest_bulk;
+		if (queue->head == queue->tail)
+			return 0;
+	} else {
+		errno = EINVAL;
+		return -1;
+	}
+	usbtest_transfer_t *transfer = queue->transfers + queue->head++ % USBTEST_QUEUE_SIZE;
+	if ((int) bulk->len < transfer->size) {
+		errno = EOVERFLOW;
+		return -1;
+	}
+	memcpy(bulk->data, transfer->data, transfer->size);
+	return transfer->size;
+}
+
+int __real_ioctl(int, unsigned long, ...);
+
+int __wrap_ioctl(int fd, unsigned long request, ...)
+{
+	va_list ap;
+	va_start(ap, request);
+	void *arg = va_arg(ap, void *);
+	va_end(ap);
+	struct stat st;
+	if (fstat(fd, &st) == -1 || st.st_dev != usbtest_node.st_dev || st.st_ino != usbtest_node.st_ino)
+		return __real_ioctl(fd, request, arg);
+	switch (request) {
+		case USBDEVFS_BULK:
+			return usbtest_transfer(arg);
+		case USBDEVFS_IOCTL:
+		case USBDEVFS_CLAIMINTERFACE:
+		case USBDEVFS_RELEASEINTERFACE:
+			return 0;
+		default:
+			errno = ENOTTY;
+			return -1;
+	}
+}
+
+typedef struct {
+	int records;
+	int points;
+} usbtest_result_t;
+
+static void usbtest_callback(void *data, int i, int records, int64_t received, const garmin_packet_t *packet)
+{
+	usbtest_result_t *result = data;
+	result->records = records;
+	if (i == 0) {
+		if (packet->id != Pid_Trk_Hdr)
+			error("record %d is packet %d, expected %d", i, packet->id, Pid_Trk_Hdr);
+		return;
+	}
+	unsigned char expected[255];
+	int size = usbtest_point(i - 1, expected);
+	if (packet->id != Pid_Trk_Data || packet->size != size || memcmp(packet->data, expected, size))
+		error("record %d differs", i);
+	++result->points;
+}
+
+static void usbtest_unlink(void)
+{
+	unlink(usbtest_path);
+}
+
+int main(void)
+{
+	int fd = mkstemp(usbtest_path);
+	if (fd == -1)
+		DIE("mkstemp", errno);
+	atexit(usbtest_unlink);
+	if (write(fd, usbtest_descriptors, sizeof usbtest_descriptors) != sizeof usbtest_descriptors)
+		DIE("write", errno);
+	if (fstat(fd, &usbtest_node) == -1)
+		DIE("fstat", errno);
+	close(fd);
+	garmin_transport_t *transport = garmin_usb_new(usbtest_path);
+	garmin_t *garmin = garmin_new_transport(transport, 0);
+	if (garmin->product_data->product_id != 484)
+		error("product id %d, expected 484", garmin->product_data->product_id);
+	if (!garmin_grep_protocol(garmin, Tag_Data_Prot_Id, 304))
+		error("protocol D304 missing");
+	usbtest_result_t result = { 0, 0 };
+	garmin_each(garmin, Cmnd_Transfer_Trk, usbtest_callback, &result);
+	if (result.records != USBTEST_POINTS + 1 || result.points != USBTEST_POINTS)
+		error("%d records and %d points, expected %d and %d", result.records, result.points, USBTEST_POINTS + 1, USBTEST_POINTS);
+	garmin_delete(garmin);
+	printf("%s: PASS: %d points over USB\n", program_name, result.points);
+	return 0;
+}
@@ -0,0 +1,434 @@
+/*
+
+   garmini - download track log from Garmin GPSs
+   Copyright (C) 2007  Tom Payne
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <float.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "cpu.h"
+#include "garmini.h"
+#include "track.h"
+
+/* The track and its points live in the session's arena and go with it. */
+garmini_track_t *garmini_track_new(garmin_arena_t *arena, int capacity)
+{
+	garmini_track_t *track = garmin_arena_alloc(arena, sizeof(garmini_track_t));
+	track->arena = arena;
+	track->capacity = capacity;
+	track->begin = garmin_arena_alloc(arena, track->capacity * sizeof(garmin_trk_point_t));
+	track->end = track->begin;
+	return track;
+}
+
+void garmini_track_push(garmini_track_t *track, const garmin_trk_point_t *trk_point)
+{
+	if (track->end - track->begin == track->capacity) {
+		int old_capacity = track->capacity;
+		track->capacity *= 2;
+		track->begin = garmin_arena_realloc(track->arena, track->begin, old_capacity * sizeof(garmin_trk_point_t), track->capacity * sizeof(garmin_trk_point_t));
+		track->end = track->begin + old_capacity;
+	}
+	*track->end++ = *trk_point;
+}
+
+double garmini_distance_fai(const garmin_trk_point_t *trk_point1, const garmin_trk_point_t *trk_point2)
+{
+	double lat1 = M_PI * trk_point1->posn.lat / 2147483648.0;
+	double lon1 = M_PI * trk_point1->posn.lon / 2147483648.0;
+	double lat2 = M_PI * trk_point2->posn.lat / 2147483648.0;
+	double lon2 = M_PI * trk_point2->posn.lon / 2147483648.0;
+	double d = sin(lat1) * sin(lat2) + cos(lat1) * cos(lat2) * cos(lon2 - lon1);
+	return d < 1.0 ? 6371000.0 * acos(d) : 0.0;
+}
+
+static int garmini_trk_point_has_posn(const garmin_trk_point_t *trk_point)
+{
+	return trk_point->posn.lat != 0x7fffffff || trk_point->posn.lon != 0x7fffffff;
+}
+
+static int garmini_trk_point_has_alt(const garmin_trk_point_t *trk_point)
+{
+	return trk_point->valid && trk_point->alt != 1.0e25f;
+}
+
+/* Summarises the points [i, j) of an indexed track.  The altitude
+ * extremes, distance and gain are range queries on the index; the climb and
+ * sink rates and the bounding box take one pass over the points. */
+void garmini_summary_range(garmini_summary_t *summary, const garmini_track_index_t *index, int i, int j)
+{
+	memset(summary, 0, sizeof(garmini_summary_t));
+	summary->npoints = j - i;
+	summary->first_time = index->begin[i].time;
+	summary->last_time = index->begin[j - 1].time;
+	summary->min_alt = garmini_track_index_min_alt(index, i, j);
+	summary->max_alt = garmini_track_index_max_alt(index, i, j);
+	summary->distance = garmini_track_index_distance(index, i, j);
+	summary->gain = garmini_track_index_gain(index, i, j);
+	summary->min_posn.lat = summary->min_posn.lon = 0x7fffffff;
+	summary->max_posn.lat = summary->max_posn.lon = 0x7fffffff;
+	const float *alt = index->min_alt[0];
+	int k;
+	for (k = i; k < j; ++k) {
+		const garmin_trk_point_t *trk_point = index->begin + k;
+		if (k > i && garmini_trk_point_has_alt(trk_point - 1) && garmini_trk_point_has_alt(trk_point) && trk_point->time > trk_point[-1].time) {
+			double vario = (alt[k] - alt[k - 1]) / (trk_point->time - trk_point[-1].time);
+			if (vario > summary->max_climb)
+				summary->max_climb = vario;
+			if (vario < summary->max_sink)
+				summary->max_sink = vario;
+		}
+		if (garmini_trk_point_has_posn(trk_point)) {
+			if (summary->min_posn.lat == 0x7fffffff || trk_point->posn.lat < summary->min_posn.lat)
+				summary->min_posn.lat = trk_point->posn.lat;
+			if (summary->min_posn.lon == 0x7fffffff || trk_point->posn.lon < summary->min_posn.lon)
+				summary->min_posn.lon = trk_point->posn.lon;
+			if (summary->max_posn.lat == 0x7fffffff || trk_point->posn.lat > summary->max_posn.lat)
+				summary->max_posn.lat = trk_point->posn.lat;
+			if (summary->max_posn.lon == 0x7fffffff || trk_point->posn.lon > summary->max_posn.lon)
+				summary->max_posn.lon = trk_point->posn.lon;
+		}
+	}
+}
+
+/* A fixed-lag Savitzky-Golay smoother over altitude: each altitude is
+ * replaced by the value at its own point of the least squares parabola through
+ * the GARMINI_SMOOTH_HALF points either side, so the output lags the input by
+ * that many points.  A window never spans a point without a valid altitude or
+ * a gap of more than GARMINI_SMOOTH_GAP seconds; near those it narrows to the
+ * widest symmetric window that fits, down to the point alone, and points
+ * without a valid altitude pass through unchanged.
+ *
+ * The track streams through in blocks of GARMINI_SMOOTH_BLOCK points, each
+ * transposed with GARMINI_SMOOTH_HALF points of context either side into
+ * structure-of-arrays buffers on the stack, so the smoother never allocates.
+ * Most points have the full window, which is a plain convolution over the
+ * altitude array; the few others are redone one by one.  The raw context is
+ * carried from block to block, so the output may overwrite the input. */
+#define GARMINI_SMOOTH_HALF 8
+#define GARMINI_SMOOTH_WINDOW (2 * GARMINI_SMOOTH_HALF + 1)
+#define GARMINI_SMOOTH_BLOCK 256
+#define GARMINI_SMOOTH_SIZE (GARMINI_SMOOTH_BLOCK + 2 * GARMINI_SMOOTH_HALF)
+#define GARMINI_SMOOTH_GAP 60
+
+typedef void (*garmini_smooth_convolve_t)(float *, const float *, const float *, int);
+
+/* Convolution kernels: out[i] is the sum of coefs[k] * in[i + k] over the
+ * window.  Every variant adds the products in the same order, without fused
+ * multiply-adds, so that all give the same result to the bit. */
+static void garmini_smooth_convolve_scalar(float *out, const float *in, const float *coefs, int n)
+{
+	int i, k;
+	for (i = 0; i < n; ++i)
+		out[i] = 0.0f;
+	for (k = 0; k < GARMINI_SMOOTH_WINDOW; ++k)
+		for (i = 0; i < n; ++i)
+			out[i] += coefs[k] * in[i + k];
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__ ((target ("sse4.2"), optimize ("fp-contract=off")))
+static void garmini_smooth_convolve_sse42(float *out, const float *in, const float *coefs, int n)
+{
+	int i, k;
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m128 sum = _mm_setzero_ps();
+		for (k = 0; k < GARMINI_SMOOTH_WINDOW; ++k)
+			sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(coefs[k]), _mm_loadu_ps(in + i + k)));
+		_mm_storeu_ps(out + i, sum);
+	}
+	garmini_smooth_convolve_scalar(out + i, in + i, coefs, n - i);
+}
+
+__attribute__ ((target ("avx2"), optimize ("fp-contract=off")))
+static void garmini_smooth_convolve_avx2(float *out, const float *in, const float *coefs, int n)
+{
+	int i, k;
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m256 sum = _mm256_setzero_ps();
+		for (k = 0; k < GARMINI_SMOOTH_WINDOW; ++k)
+			sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_set1_ps(coefs[k]), _mm256_loadu_ps(in + i + k)));
+		_mm256_storeu_ps(out + i, sum);
+	}
+	garmini_smooth_convolve_scalar(out + i, in + i, coefs, n - i);
+}
+
+__attribute__ ((target ("avx512f,avx512bw"), optimize ("fp-contract=off")))
+static void garmini_smooth_convolve_avx512(float *out, const float *in, const float *coefs, int n)
+{
+	int i, k;
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m512 sum = _mm512_setzero_ps();
+		for (k = 0; k < GARMINI_SMOOTH_WINDOW; ++k)
+			sum = _mm512_add_ps(sum, _mm512_mul_ps(_mm512_set1_ps(coefs[k]), _mm512_loadu_ps(in + i + k)));
+		_mm512_storeu_ps(out + i, sum);
+	}
+	garmini_smooth_convolve_scalar(out + i, in + i, coefs, n - i);
+}
+#endif
+
+static garmini_smooth_convolve_t garmini_smooth_convolve(void)
+{
+	switch (garmini_cpu()) {
+#if defined(__x86_64__) || defined(__i386__)
+		case GARMINI_CPU_AVX512:
+			return garmini_smooth_convolve_avx512;
+		case GARMINI_CPU_AVX2:
+			return garmini_smooth_convolve_avx2;
+		case GARMINI_CPU_SSE42:
+			return garmini_smooth_convolve_sse42;
+#endif
+		default:
+			return garmini_smooth_convolve_scalar;
+	}
+}
+
+/* coefs[h] holds the quadratic smoothing coefficients for the window of half
+ * width h, centred in the row. */
+static void garmini_smooth_coefs(float coefs[GARMINI_SMOOTH_HALF + 1][GARMINI_SMOOTH_WINDOW])
+{
+	memset(coefs, 0, (GARMINI_SMOOTH_HALF + 1) * sizeof *coefs);
+	coefs[0][GARMINI_SMOOTH_HALF] = 1.0f;
+	int h, k;
+	for (h = 1; h <= GARMINI_SMOOTH_HALF; ++h)
+		for (k = -h; k <= h; ++k)
+			coefs[h][GARMINI_SMOOTH_HALF + k] = (3.0 * (3 * h * h + 3 * h - 1) - 15.0 * k * k) / ((2 * h - 1) * (2 * h + 1) * (2 * h + 3));
+}
+
+/* Writes the smoothed altitude of each point in [begin, end) to out, stride
+ * bytes apart. */
+static void garmini_smooth(const garmin_trk_point_t *begin, const garmin_trk_point_t *end, float *out, size_t stride)
+{
+	garmini_smooth_convolve_t convolve = garmini_smooth_convolve();
+	float coefs[GARMINI_SMOOTH_HALF + 1][GARMINI_SMOOTH_WINDOW];
+	garmini_smooth_coefs(coefs);
+	uint32_t time[GARMINI_SMOOTH_SIZE];
+	float alt[GARMINI_SMOOTH_SIZE];
+	unsigned char valid[GARMINI_SMOOTH_SIZE];
+	unsigned char left[GARMINI_SMOOTH_SIZE];
+	unsigned char right[GARMINI_SMOOTH_SIZE];
+	float smoothed[GARMINI_SMOOTH_BLOCK];
+	int n = end - begin;
+	int start, p;
+	/* Buffer position p holds point start - GARMINI_SMOOTH_HALF + p. */
+	for (start = 0; start < n; start += GARMINI_SMOOTH_BLOCK) {
+		int from = 0;
+		if (start) {
+			memmove(time, time + GARMINI_SMOOTH_BLOCK, 2 * GARMINI_SMOOTH_HALF * sizeof *time);
+			memmove(alt, alt + GARMINI_SMOOTH_BLOCK, 2 * GARMINI_SMOOTH_HALF * sizeof *alt);
+			memmove(valid, valid + GARMINI_SMOOTH_BLOCK, 2 * GARMINI_SMOOTH_HALF * sizeof *valid);
+			from = 2 * GARMINI_SMOOTH_HALF;
+		}
+		for (p = from; p < GARMINI_SMOOTH_SIZE; ++p) {
+			int i = start - GARMINI_SMOOTH_HALF + p;
+			if (i < 0 || i >= n) {
+				time[p] = 0;
+				alt[p] = 0.0f;
+				valid[p] = 0;
+			} else {
+				time[p] = begin[i].time;
+				alt[p] = begin[i].alt;
+				valid[p] = garmini_trk_point_has_alt(begin + i);
+			}
+		}
+		/* left[p] and right[p] count the points, up to GARMINI_SMOOTH_HALF,
+		 * that a window centred on p may take on each side.  They are exact
+		 * for the block itself, whose windows stay inside the buffer. */
+		left[0] = 0;
+		for (p = 1; p < GARMINI_SMOOTH_SIZE; ++p) {
+			int linked = valid[p - 1] && valid[p] && time[p] >= time[p - 1] && time[p] - time[p - 1] <= GARMINI_SMOOTH_GAP;
+			left[p] = linked ? (left[p - 1] < GARMINI_SMOOTH_HALF ? left[p - 1] + 1 : GARMINI_SMOOTH_HALF) : 0;
+		}
+		right[GARMINI_SMOOTH_SIZE - 1] = 0;
+		for (p = GARMINI_SMOOTH_SIZE - 2; p >= 0; --p)
+			right[p] = left[p + 1] ? (right[p + 1] < GARMINI_SMOOTH_HALF ? right[p + 1] + 1 : GARMINI_SMOOTH_HALF) : 0;
+		int count = n - start < GARMINI_SMOOTH_BLOCK ? n - start : GARMINI_SMOOTH_BLOCK;
+		convolve(smoothed, alt, coefs[GARMINI_SMOOTH_HALF], count);
+		for (p = GARMINI_SMOOTH_HALF; p < GARMINI_SMOOTH_HALF + count; ++p) {
+			float value = smoothed[p - GARMINI_SMOOTH_HALF];
+			int h = left[p] < right[p] ? left[p] : right[p];
+			if (!valid[p] || h == 0) {
+				value = alt[p];
+			} else if (h < GARMINI_SMOOTH_HALF) {
+				value = 0.0f;
+				int k;
+				for (k = -h; k <= h; ++k)
+					value += coefs[h][GARMINI_SMOOTH_HALF + k] * alt[p + k];
+			}
+			*(float *) ((char *) out + (start - GARMINI_SMOOTH_HALF + p) * stride) = value;
+		}
+	}
+}
+
+/* Writes the smoothed altitude of each point of the track to alt, leaving
+ * the points themselves alone. */
+void garmini_track_smoothed(const garmini_track_t *track, float *alt)
+{
+	garmini_smooth(track->begin, track->end, alt, sizeof *alt);
+}
+
+void garmini_track_smooth(garmini_track_t *track)
+{
+	garmini_smooth(track->begin, track->end, &track->begin->alt, sizeof *track->begin);
+}
+
+/* Builds n entries of a sparse table level from the level below, each the
+ * minimum or maximum of the two entries half apart. */
+static void garmini_minmax(float *min, float *max, const float *min0, const float *max0, int half, int n)
+{
+	int i;
+	for (i = 0; i < n; ++i) {
+		min[i] = min0[i] < min0[i + half] ? min0[i] : min0[i + half];
+		max[i] = max0[i] > max0[i + half] ? max0[i] : max0[i + half];
+	}
+}
+
+/* alt, if not null, gives the altitude to index for each point in place of
+ * its own, for example one smoothed for analysis.  Points without a valid
+ * altitude are left out of the altitude queries either way. */
+garmini_track_index_t *garmini_track_index_new(const garmin_trk_point_t *begin, const garmin_trk_point_t *end, const float *alt)
+{
+	garmini_track_index_t *index = alloc(sizeof(garmini_track_index_t));
+	index->begin = begin;
+	index->n = end - begin;
+	if (!index->n)
+		return index;
+	index->distance = alloc(index->n * sizeof(double));
+	index->gain = alloc(index->n * sizeof(double));
+	index->levels = 1;
+	while (1 << index->levels <= index->n)
+		++index->levels;
+	index->min_alt = alloc(index->levels * sizeof(float *));
+	index->max_alt = alloc(index->levels * sizeof(float *));
+	index->min_alt[0] = alloc(index->n * sizeof(float));
+	index->max_alt[0] = alloc(index->n * sizeof(float));
+	int i;
+	for (i = 0; i < index->n; ++i) {
+		const garmin_trk_point_t *trk_point = begin + i;
+		if (garmini_trk_point_has_alt(trk_point)) {
+			index->min_alt[0][i] = index->max_alt[0][i] = alt ? alt[i] : trk_point->alt;
+		} else {
+			index->min_alt[0][i] = FLT_MAX;
+			index->max_alt[0][i] = -FLT_MAX;
+		}
+		if (i == 0)
+			continue;
+		index->distance[i] = index->distance[i - 1];
+		if (garmini_trk_point_has_posn(trk_point - 1) && garmini_trk_point_has_posn(trk_point))
+			index->distance[i] += garmini_distance_fai(trk_point - 1, trk_point);
+		index->gain[i] = index->gain[i - 1];
+		if (garmini_trk_point_has_alt(trk_point - 1) && garmini_trk_point_has_alt(trk_point) && index->min_alt[0][i] > index->min_alt[0][i - 1])
+			index->gain[i] += index->min_alt[0][i] - index->min_alt[0][i - 1];
+	}
+	int level;
+	for (level = 1; level < index->levels; ++level) {
+		int half = 1 << (level - 1);
+		int size = index->n - (1 << level) + 1;
+		index->min_alt[level] = alloc(size * sizeof(float));
+		index->max_alt[level] = alloc(size * sizeof(float));
+		garmini_minmax(index->min_alt[level], index->max_alt[level], index->min_alt[level - 1], index->max_alt[level - 1], half, size);
+	}
+	return index;
+}
+
+void garmini_track_index_delete(garmini_track_index_t *index)
+{
+	if (index) {
+		int level;
+		for (level = 0; level < index->levels; ++level) {
+			free(index->min_alt[level]);
+			free(index->max_alt[level]);
+		}
+		free(index->min_alt);
+		free(index->max_alt);
+		free(index->distance);
+		free(index->gain);
+		free(index);
+	}
+}
+
+/* Returns the index of the first point at or after time, or n if there is
+ * none.  Times are Garmin times, as stored in garmin_trk_point_t, and must not
+ * decrease along the track. */
+int garmini_track_index_find(const garmini_track_index_t *index, time_t time)
+{
+	int lo = 0, hi = index->n;
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (index->begin[mid].time < time)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Locates the half-open range of points [*i, *j) with times in [time1,
+ * time2] and returns the number of points in it. */
+int garmini_track_index_range(const garmini_track_index_t *index, time_t time1, time_t time2, int *i, int *j)
+{
+	*i = garmini_track_index_find(index, time1);
+	*j = time2 < time1 ? *i : garmini_track_index_find(index, time2 + 1);
+	return *j - *i;
+}
+
+double garmini_track_index_distance(const garmini_track_index_t *index, int i, int j)
+{
+	return j - i < 2 ? 0.0 : index->distance[j - 1] - index->distance[i];
+}
+
+double garmini_track_index_gain(const garmini_track_index_t *index, int i, int j)
+{
+	return j - i < 2 ? 0.0 : index->gain[j - 1] - index->gain[i];
+}
+
+static int garmini_track_index_level(int n)
+{
+	int level = 0;
+	while (2 << level <= n)
+		++level;
+	return level;
+}
+
+/* Returns FLT_MAX if the range contains no valid altitude. */
+float garmini_track_index_min_alt(const garmini_track_index_t *index, int i, int j)
+{
+	if (j <= i)
+		return FLT_MAX;
+	int level = garmini_track_index_level(j - i);
+	float a = index->min_alt[level][i];
+	float b = index->min_alt[level][j - (1 << level)];
+	return a < b ? a : b;
+}
+
+/* Returns -FLT_MAX if the range contains no valid altitude. */
+float garmini_track_index_max_alt(const garmini_track_index_t *index, int i, int j)
+{
+	if (j <= i)
+		return -FLT_MAX;
+	int level = garmini_track_index_level(j - i);
+	float a = index->max_alt[level][i];
+	float b = index->max_alt[level][j - (1 << level)];
+	return a > b ? a : b;
+}
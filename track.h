@@ -0,0 +1,75 @@
+/*
+
+   garmini - download track log from Garmin GPSs
+   Copyright (C) 2007  Tom Payne
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef TRACK_H
+#define TRACK_H
+
+#include "garmin.h"
+
+typedef struct {
+	garmin_arena_t *arena;
+	int capacity;
+	garmin_trk_point_t *begin;
+	garmin_trk_point_t *end;
+} garmini_track_t;
+
+/* Range queries over a track: prefix sums answer distance and altitude gain,
+ * sparse tables answer minimum and maximum altitude, all in O(1) once the
+ * range has been located by binary search on the timestamps. */
+typedef struct {
+	const garmin_trk_point_t *begin;
+	int n;
+	double *distance;
+	double *gain;
+	int levels;
+	float **min_alt;
+	float **max_alt;
+} garmini_track_index_t;
+
+typedef struct {
+	int npoints;
+	time_t first_time;
+	time_t last_time;
+	float min_alt;
+	float max_alt;
+	double distance;
+	double gain;
+	double max_climb;
+	double max_sink;
+	position_t min_posn;
+	position_t max_posn;
+} garmini_summary_t;
+
+garmini_track_t *garmini_track_new(garmin_arena_t *, int);
+void garmini_track_push(garmini_track_t *, const garmin_trk_point_t *);
+double garmini_distance_fai(const garmin_trk_point_t *, const garmin_trk_point_t *);
+void garmini_summary_range(garmini_summary_t *, const garmini_track_index_t *, int, int);
+void garmini_track_smoothed(const garmini_track_t *, float *);
+void garmini_track_smooth(garmini_track_t *);
+garmini_track_index_t *garmini_track_index_new(const garmin_trk_point_t *, const garmin_trk_point_t *, const float *);
+void garmini_track_index_delete(garmini_track_index_t *);
+int garmini_track_index_find(const garmini_track_index_t *, time_t);
+int garmini_track_index_range(const garmini_track_index_t *, time_t, time_t, int *, int *);
+double garmini_track_index_distance(const garmini_track_index_t *, int, int);
+double garmini_track_index_gain(const garmini_track_index_t *, int, int);
+float garmini_track_index_min_alt(const garmini_track_index_t *, int, int);
+float garmini_track_index_max_alt(const garmini_track_index_t *, int, int);
+
+#endif
@@ -0,0 +1,300 @@
+/*
+
+   garmini - download track log from Garmin GPSs
+   Copyright (C) 2007  Tom Payne
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <linux/usbdevice_fs.h>
+
+#include "garmini.h"
+#include "usb.h"
+
+/* USB units talk to the host through Linux's usbfs, so no library is needed.
+ * Each transfer carries one packet behind a twelve byte header, with neither
+ * DLE stuffing nor link level ACKs.  The device announces data on its
+ * interrupt endpoint, either as application packets or as Pkt_Data_Available,
+ * in which case packets follow on the bulk endpoint until an empty transfer.
+ * Application packet ids are those of the serial link. */
+
+#define GARMIN_USB_DIRECTORY "/dev/bus/usb"
+#define GARMIN_USB_VENDOR_ID 0x091e
+#define GARMIN_USB_WRITE_TIMEOUT 1000
+#define GARMIN_USB_MAX_DATA_SIZE 4096
+
+enum {
+	Pkt_Type_Protocol_Layer    = 0,
+	Pkt_Type_Application_Layer = 20
+};
+
+enum {
+	Pkt_Data_Available  = 2,
+	Pkt_Start_Session   = 5,
+	Pkt_Session_Started = 6
+};
+
+enum {
+	Pid_Ext_Product_Data = 248
+};
+
+typedef struct {
+	uint8_t type;
+	uint8_t reserved1[3];
+	uint16_t id;
+	uint8_t reserved2[2];
+	uint32_t size;
+} __attribute__ ((packed)) garmin_usb_header_t;
+
+typedef struct {
+	garmin_transport_t transport;
+	char *path;
+	int fd;
+	int bulk_in;
+	int bulk_out;
+	int interrupt_in;
+	int max_packet_size;
+	int bulk;
+	unsigned char buf[sizeof(garmin_usb_header_t) + GARMIN_USB_MAX_DATA_SIZE];
+} garmin_usb_t;
+
+static int garmin_usb_transfer(garmin_usb_t *usb, int endpoint, void *data, int size, int timeout_msec)
+{
+	struct usbdevfs_bulktransfer bulk;
+	bulk.ep = endpoint;
+	bulk.len = size;
+	bulk.timeout = timeout_msec;
+	bulk.data = data;
+	int n;
+	do {
+		n = ioctl(usb->fd, USBDEVFS_BULK, &bulk);
+	} while (n == -1 && errno == EINTR);
+	if (n == -1) {
+		if (errno == ETIMEDOUT)
+			return -1;
+		error("%s: transfer failed: %s", usb->path, strerror(errno));
+	}
+	return n;
+}
+
+/* Reads one packet of either layer, returning -1 on timeout. */
+static int garmin_usb_read(garmin_usb_t *usb, int endpoint, garmin_usb_header_t **header, int timeout_msec)
+{
+	int n = garmin_usb_transfer(usb, endpoint, usb->buf, sizeof usb->buf, timeout_msec);
+	if (n <= 0)
+		return -1;
+	if (n < (int) sizeof(garmin_usb_header_t))
+		error("%s: packet too short", usb->path);
+	*header = (garmin_usb_header_t *) usb->buf;
+	if (sizeof(garmin_usb_header_t) + (*header)->size > (unsigned) n)
+		error("%s: incomplete packet", usb->path);
+	return (*header)->id;
+}
+
+static void garmin_usb_write(garmin_usb_t *usb, int type, int id, const unsigned char *data, int size)
+{
+	unsigned char buf[sizeof(garmin_usb_header_t) + 255];
+	garmin_usb_header_t *header = (garmin_usb_header_t *) buf;
+	memset(header, 0, sizeof(garmin_usb_header_t));
+	header->type = type;
+	header->id = id;
+	header->size = size;
+	memcpy(buf + sizeof(garmin_usb_header_t), data, size);
+	int n = sizeof(garmin_usb_header_t) + size;
+	if (garmin_usb_transfer(usb, usb->bulk_out, buf, n, GARMIN_USB_WRITE_TIMEOUT) != n)
+		error("%s: short write", usb->path);
+	if (n % usb->max_packet_size == 0)
+		garmin_usb_transfer(usb, usb->bulk_out, buf, 0, GARMIN_USB_WRITE_TIMEOUT);
+}
+
+static int garmin_usb_read_packet(garmin_transport_t *transport, garmin_packet_t *packet, int64_t timeout)
+{
+	garmin_usb_t *usb = (garmin_usb_t *) transport;
+	int timeout_msec = timeout < 1000 ? 1 : (timeout + 999) / 1000;
+	while (1) {
+		garmin_usb_header_t *header;
+		if (usb->bulk) {
+			if (garmin_usb_read(usb, usb->bulk_in, &header, timeout_msec) == -1) {
+				usb->bulk = 0;
+				continue;
+			}
+		} else {
+			if (garmin_usb_read(usb, usb->interrupt_in, &header, timeout_msec) == -1)
+				return EOF;
+		}
+		if (header->type == Pkt_Type_Protocol_Layer) {
+			if (header->id == Pkt_Data_Available)
+				usb->bulk = 1;
+			continue;
+		}
+		if (header->type != Pkt_Type_Application_Layer)
+			continue;
+		/* Unlike serial packets, USB packets may outgrow a byte's length,
+		 * but only Ext_Product_Data does, and it is ignored anyway. */
+		if (header->size > sizeof packet->data) {
+			if (header->id == Pid_Ext_Product_Data)
+				continue;
+			error("%s: packet %d too long", usb->path, header->id);
+		}
+		packet->id = header->id;
+		packet->size = header->size;
+		memcpy(packet->data, header + 1, header->size);
+		return packet->id;
+	}
+}
+
+static void garmin_usb_write_packet(garmin_transport_t *transport, const garmin_packet_t *packet)
+{
+	garmin_usb_t *usb = (garmin_usb_t *) transport;
+	garmin_usb_write(usb, Pkt_Type_Application_Layer, packet->id, packet->data, packet->size);
+}
+
+static void garmin_usb_delete(garmin_transport_t *transport)
+{
+	garmin_usb_t *usb = (garmin_usb_t *) transport;
+	int interface = 0;
+	ioctl(usb->fd, USBDEVFS_RELEASEINTERFACE, &interface);
+	if (close(usb->fd) == -1)
+		DIE("close", errno);
+	free(usb->path);
+	free(usb);
+}
+
+/* Reading a usbfs node returns the device descriptor followed by the
+ * configuration descriptors.  The endpoints are those of the first
+ * interface of the first configuration. */
+static int garmin_usb_probe(garmin_usb_t *usb)
+{
+	unsigned char buf[1024];
+	int n = read(usb->fd, buf, sizeof buf);
+	if (n < 18 || buf[1] != 1)
+		return 0;
+	if ((buf[8] | buf[9] << 8) != GARMIN_USB_VENDOR_ID)
+		return 0;
+	int interface = -1;
+	int i;
+	for (i = buf[0]; i + 2 <= n && buf[i] >= 2 && i + buf[i] <= n; i += buf[i]) {
+		const unsigned char *descriptor = buf + i;
+		if (descriptor[1] == 2 && i != buf[0])
+			break;
+		if (descriptor[1] == 4 && descriptor[0] >= 3)
+			interface = descriptor[2];
+		if (descriptor[1] != 5 || descriptor[0] < 7 || interface != 0)
+			continue;
+		int address = descriptor[2];
+		int type = descriptor[3] & 3;
+		if (type == 2 && (address & 0x80)) {
+			usb->bulk_in = address;
+		} else if (type == 2) {
+			usb->bulk_out = address;
+			usb->max_packet_size = (descriptor[4] | descriptor[5] << 8) & 0x7ff;
+		} else if (type == 3 && (address & 0x80)) {
+			usb->interrupt_in = address;
+		}
+	}
+	return usb->bulk_in && usb->bulk_out && usb->interrupt_in && usb->max_packet_size;
+}
+
+static int garmin_usb_open(garmin_usb_t *usb, const char *path)
+{
+	usb->fd = open(path, O_RDWR);
+	if (usb->fd == -1)
+		return 0;
+	usb->bulk_in = usb->bulk_out = usb->interrupt_in = usb->max_packet_size = 0;
+	if (!garmin_usb_probe(usb)) {
+		close(usb->fd);
+		return 0;
+	}
+	usb->path = strdup(path);
+	if (!usb->path)
+		DIE("strdup", errno);
+	return 1;
+}
+
+static int garmin_usb_find(garmin_usb_t *usb)
+{
+	DIR *buses = opendir(GARMIN_USB_DIRECTORY);
+	if (!buses)
+		return 0;
+	int found = 0;
+	struct dirent *bus;
+	while (!found && (bus = readdir(buses))) {
+		if (bus->d_name[0] == '.')
+			continue;
+		char path[sizeof GARMIN_USB_DIRECTORY + 2 * 256];
+		snprintf(path, sizeof path, "%s/%s", GARMIN_USB_DIRECTORY, bus->d_name);
+		DIR *devices = opendir(path);
+		if (!devices)
+			continue;
+		struct dirent *device;
+		while (!found && (device = readdir(devices))) {
+			if (device->d_name[0] == '.')
+				continue;
+			snprintf(path, sizeof path, "%s/%s/%s", GARMIN_USB_DIRECTORY, bus->d_name, device->d_name);
+			found = garmin_usb_open(usb, path);
+		}
+		closedir(devices);
+	}
+	closedir(buses);
+	return found;
+}
+
+/* device is either the path of a usbfs node or empty, in which case the first
+ * Garmin device found is used. */
+garmin_transport_t *garmin_usb_new(const char *device)
+{
+	garmin_usb_t *usb = alloc(sizeof(garmin_usb_t));
+	if (*device) {
+		if (!garmin_usb_open(usb, device))
+			error("%s: not a Garmin USB device", device);
+	} else if (!garmin_usb_find(usb)) {
+		error("no Garmin USB device found");
+	}
+	usb->transport.read = 0;
+	usb->transport.write = 0;
+	usb->transport.delete = garmin_usb_delete;
+	usb->transport.read_packet = garmin_usb_read_packet;
+	usb->transport.write_packet = garmin_usb_write_packet;
+	usb->transport.name = usb->path;
+	usb->transport.clock = &garmin_real_clock;
+	usb->transport.baud = 0;
+	usb->bulk = 0;
+	struct usbdevfs_ioctl command;
+	command.ifno = 0;
+	command.ioctl_code = USBDEVFS_DISCONNECT;
+	command.data = 0;
+	ioctl(usb->fd, USBDEVFS_IOCTL, &command);
+	int interface = 0;
+	if (ioctl(usb->fd, USBDEVFS_CLAIMINTERFACE, &interface) == -1)
+		error("%s: cannot claim interface: %s", usb->path, strerror(errno));
+	garmin_usb_write(usb, Pkt_Type_Protocol_Layer, Pkt_Start_Session, 0, 0);
+	int i;
+	for (i = 0; i < 10; ++i) {
+		garmin_usb_header_t *header;
+		if (garmin_usb_read(usb, usb->interrupt_in, &header, GARMIN_USB_WRITE_TIMEOUT) == -1)
+			continue;
+		if (header->type == Pkt_Type_Protocol_Layer && header->id == Pkt_Session_Started)
+			return &usb->transport;
+	}
+	error("%s: session did not start", usb->path);
+	return 0;
+}